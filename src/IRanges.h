@@ -207,34 +207,85 @@ Ints_holder _get_elt_from_CompressedIntsList_holder(
 
 SEXP RleViews_viewMins(
 	SEXP x,
-	SEXP na_rm
+	SEXP na_rm,
+	SEXP use_index
 );
 
 SEXP RleViews_viewMaxs(
 	SEXP x,
-	SEXP na_rm
+	SEXP na_rm,
+	SEXP use_index
 );
 
 SEXP RleViews_viewSums(
 	SEXP x,
-	SEXP na_rm
+	SEXP na_rm,
+	SEXP use_index
 );
 
 SEXP RleViews_viewMeans(
 	SEXP x,
-	SEXP na_rm
+	SEXP na_rm,
+	SEXP use_index
 );
 
 SEXP RleViews_viewWhichMins(
 	SEXP x,
-	SEXP na_rm
+	SEXP na_rm,
+	SEXP use_index
 );
 
 SEXP RleViews_viewWhichMaxs(
+	SEXP x,
+	SEXP na_rm,
+	SEXP use_index
+);
+
+SEXP RleViews_viewSummaries(
+	SEXP x,
+	SEXP na_rm,
+	SEXP stats,
+	SEXP nthreads
+);
+
+SEXP RleViewsList_viewSummaries(
+	SEXP x,
+	SEXP na_rm,
+	SEXP stats,
+	SEXP nthreads
+);
+
+SEXP vector_viewSummaries(
+	SEXP x,
+	SEXP ranges,
+	SEXP na_rm,
+	SEXP stats,
+	SEXP use_index,
+	SEXP nthreads
+);
+
+SEXP RleViews_viewMedians(
+	SEXP x,
+	SEXP na_rm
+);
+
+SEXP RleViews_viewQuantiles(
+	SEXP x,
+	SEXP na_rm,
+	SEXP probs
+);
+
+SEXP RleViews_viewVars(
 	SEXP x,
 	SEXP na_rm
 );
 
+SEXP RleViews_viewCountsAbove(
+	SEXP x,
+	SEXP threshold,
+	SEXP na_rm
+);
+
 
 /* CompressedIRangesList_class.c */
 
@@ -315,6 +366,8 @@ SEXP Ranges_disjointBins(
 
 /* coverage_methods.c */
 
+int _get_nthreads(SEXP nthreads);
+
 SEXP IRanges_coverage(
 	SEXP x,
 	SEXP shift,
@@ -324,18 +377,96 @@ SEXP IRanges_coverage(
 	SEXP method
 );
 
+SEXP IRanges_coverage_costs(
+	SEXP x,
+	SEXP shift,
+	SEXP width,
+	SEXP weight,
+	SEXP circle_len
+);
+
+SEXP coverage_set_cost_scales(SEXP scales);
+
 SEXP CompressedIRangesList_coverage(
 	SEXP x,
 	SEXP shift,
 	SEXP width,
 	SEXP weight,
 	SEXP circle_lens,
-	SEXP method
+	SEXP method,
+	SEXP nthreads
+);
+
+SEXP CoverageAcc_new(SEXP width);
+
+SEXP CoverageAcc_free(SEXP acc_xp);
+
+SEXP CoverageAcc_add(
+	SEXP acc_xp,
+	SEXP start,
+	SEXP width,
+	SEXP weight
+);
+
+SEXP CoverageAcc_as_Rle(SEXP acc_xp);
+
+SEXP IRanges_coverage_islands(
+	SEXP x,
+	SEXP shift,
+	SEXP width,
+	SEXP weight,
+	SEXP lower,
+	SEXP upper,
+	SEXP include_lower,
+	SEXP include_upper,
+	SEXP with_max,
+	SEXP with_sum
+);
+
+SEXP Rle_slice(
+	SEXP x,
+	SEXP lower,
+	SEXP upper,
+	SEXP include_lower,
+	SEXP include_upper,
+	SEXP with_max,
+	SEXP with_sum
+);
+
+SEXP RleList_slice(
+	SEXP x,
+	SEXP lower,
+	SEXP upper,
+	SEXP include_lower,
+	SEXP include_upper,
+	SEXP with_max,
+	SEXP with_sum
+);
+
+SEXP IRanges_binned_coverage(
+	SEXP x,
+	SEXP shift,
+	SEXP width,
+	SEXP weight,
+	SEXP bin_start,
+	SEXP bin_width,
+	SEXP fun
+);
+
+SEXP CompressedIRangesList_coverage_matrix(
+	SEXP x,
+	SEXP shift,
+	SEXP width,
+	SEXP weight
 );
 
 
 /* NCList.c */
 
+SEXP NCList_enable_stats(SEXP enable);
+
+SEXP NCList_get_stats();
+
 SEXP NCList_new();
 
 SEXP NCList_free(SEXP nclist_xp);
@@ -357,6 +488,11 @@ SEXP NCListAsINTSXP_print(
 	SEXP x_end
 );
 
+SEXP NCList_fingerprint(
+	SEXP x_start,
+	SEXP x_end
+);
+
 SEXP NCList_find_overlaps(
 	SEXP q_start,
 	SEXP q_end,
@@ -368,7 +504,8 @@ SEXP NCList_find_overlaps(
 	SEXP minoverlap,
 	SEXP type,
 	SEXP select,
-	SEXP circle_length
+	SEXP circle_length,
+	SEXP with_gap
 );
 
 SEXP NCList_find_overlaps_in_groups(
@@ -389,6 +526,31 @@ SEXP NCList_find_overlaps_in_groups(
 	SEXP circle_length
 );
 
+void _find_any_overlaps(
+	const int *q_start_p,
+	const int *q_end_p,
+	int q_len,
+	const int *s_start_p,
+	const int *s_end_p,
+	int s_len,
+	int select_mode,
+	IntAE *qh_buf,
+	IntAE *sh_buf,
+	int *direct_out
+);
+
+
+/* nearest_methods.c */
+
+SEXP Ranges_distanceToNearest(
+	SEXP x_start,
+	SEXP x_end,
+	SEXP s_start,
+	SEXP s_end,
+	SEXP select_all,
+	SEXP drop_self
+);
+
 /* CompressedAtomicList_utils.c */
 
 SEXP CompressedLogicalList_sum(
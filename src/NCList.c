@@ -7,32 +7,103 @@
 
 #include <stdlib.h>  /* for malloc, realloc, free, abs */
 #include <math.h>    /* for log10 */
+#include <stdio.h>   /* for snprintf */
+#include <time.h>    /* for clock */
 
-/*
-#include <time.h>
-static double cumulated_time = 0.0;
+
+/****************************************************************************
+ * Opt-in instrumentation
+ *
+ * When enabled (with NCList_enable_stats()), the .Call entry points below
+ * that build or search an NCList reset the counters on entry and update them
+ * as they go. They can be retrieved with NCList_get_stats() after the call.
+ * When disabled (the default), the cost is a test on 'stats_enabled' in the
+ * hot loops.
+ */
+
+typedef struct nclist_stats_t {
+	double build_time;    /* in seconds */
+	double query_time;    /* in seconds */
+	double nbsearch;      /* nb of calls to int_bsearch() */
+	double nvisited;      /* nb of NCList nodes visited */
+	double nhit;          /* nb of hits reported */
+	int max_depth;        /* max depth reached during the searches */
+	int nrealloc;         /* nb of buffer reallocations */
+	int rec_depth;        /* current depth of the recursive searches */
+} NCListStats;
+
+static int stats_enabled = 0;
+static NCListStats stats;
 static clock_t clock0;
 
+#define	STATS(expr) do { if (stats_enabled) { expr; } } while (0)
+
+static void reset_stats()
+{
+	memset(&stats, 0, sizeof(NCListStats));
+	return;
+}
+
 static void start_clock()
 {
 	clock0 = clock();
+	return;
 }
-static void stop_clock()
+
+static double get_elapsed_time()
 {
-	cumulated_time += ((double) clock() - clock0) / CLOCKS_PER_SEC;
+	return ((double) clock() - clock0) / CLOCKS_PER_SEC;
 }
-static void init_clock(const char *msg)
+
+static void update_max_depth(int depth)
 {
-	printf("%s", msg);
-	cumulated_time = 0.0;
-	clock0 = clock();
+	if (depth > stats.max_depth)
+		stats.max_depth = depth;
+	return;
 }
-static void print_elapsed_time()
+
+/* --- .Call ENTRY POINT ---
+ * Turn the instrumentation on or off. Return its previous state. */
+SEXP NCList_enable_stats(SEXP enable)
 {
-	stop_clock();
-	printf("%8.6f s\n", cumulated_time);
+	int old_state;
+
+	if (!IS_LOGICAL(enable) || LENGTH(enable) != 1
+	 || LOGICAL(enable)[0] == NA_LOGICAL)
+		error("'enable' must be TRUE or FALSE");
+	old_state = stats_enabled;
+	stats_enabled = LOGICAL(enable)[0];
+	reset_stats();
+	return ScalarLogical(old_state);
+}
+
+/* --- .Call ENTRY POINT ---
+ * Return the counters collected during the last instrumented call as a
+ * named list. */
+SEXP NCList_get_stats()
+{
+	SEXP ans, ans_names;
+
+	PROTECT(ans = NEW_LIST(7));
+	SET_VECTOR_ELT(ans, 0, ScalarReal(stats.build_time));
+	SET_VECTOR_ELT(ans, 1, ScalarReal(stats.query_time));
+	SET_VECTOR_ELT(ans, 2, ScalarReal(stats.nbsearch));
+	SET_VECTOR_ELT(ans, 3, ScalarReal(stats.nvisited));
+	SET_VECTOR_ELT(ans, 4, ScalarReal(stats.nhit));
+	SET_VECTOR_ELT(ans, 5, ScalarInteger(stats.max_depth));
+	SET_VECTOR_ELT(ans, 6, ScalarInteger(stats.nrealloc));
+	PROTECT(ans_names = NEW_CHARACTER(7));
+	SET_STRING_ELT(ans_names, 0, mkChar("build_time"));
+	SET_STRING_ELT(ans_names, 1, mkChar("query_time"));
+	SET_STRING_ELT(ans_names, 2, mkChar("bsearch_calls"));
+	SET_STRING_ELT(ans_names, 3, mkChar("nodes_visited"));
+	SET_STRING_ELT(ans_names, 4, mkChar("hits"));
+	SET_STRING_ELT(ans_names, 5, mkChar("max_depth"));
+	SET_STRING_ELT(ans_names, 6, mkChar("reallocs"));
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(2);
+	return ans;
 }
-*/
 
 
 /****************************************************************************
@@ -56,6 +127,7 @@ static void *realloc2(void *ptr, int new_nmemb, int old_nmemb, size_t size)
 	if (new_ptr == NULL)
 		error("IRanges internal error in realloc2(): "
 		      "memory (re)allocation failed");
+	STATS(stats.nrealloc++);
 	return new_ptr;
 }
 
@@ -357,7 +429,6 @@ SEXP NCList_new()
 {
 	NCList *top_nclist;
 
-	//init_clock("preprocessing: T1 = ");
 	top_nclist = (NCList *) malloc(sizeof(NCList));
 	if (top_nclist == NULL)
 		error("NCList_new: memory allocation failed");
@@ -523,7 +594,9 @@ SEXP NCList_build(SEXP nclist_xp, SEXP x_start, SEXP x_end, SEXP x_subset)
 		x_subset_p = INTEGER(x_subset);
 		x_len = LENGTH(x_subset);
 	}
+	STATS(reset_stats(); start_clock());
 	build_NCList(top_nclist, x_start_p, x_end_p, x_subset_p, x_len);
+	STATS(stats.build_time = get_elapsed_time());
 	return nclist_xp;
 }
 
@@ -618,7 +691,6 @@ SEXP new_NCListAsINTSXP_from_NCList(SEXP nclist_xp)
 	PROTECT(ans = NEW_INTEGER(ans_len));
 	dump_NCList_to_int_array_rec(top_nclist, INTEGER(ans));
 	UNPROTECT(1);
-	//print_elapsed_time();
 	return ans;
 }
 
@@ -681,6 +753,53 @@ SEXP NCListAsINTSXP_print(SEXP x_nclist, SEXP x_start, SEXP x_end)
 }
 
 
+/****************************************************************************
+ * NCList_fingerprint()
+ *
+ * A cheap fingerprint of a set of ranges, used as the key of the cache of
+ * NCLists (see .get_cached_nclist() in R/NCList-class.R). This is a 64-bit
+ * FNV-1a hash of the starts and ends, combined with the number of ranges.
+ * Different sets of ranges can get the same fingerprint, so a cache hit is
+ * confirmed by comparing the ranges themselves.
+ */
+
+#define	FNV1A_OFFSET_BASIS 14695981039346656037ULL
+#define	FNV1A_PRIME 1099511628211ULL
+
+static unsigned long long fnv1a_ints(unsigned long long h,
+				     const int *x, int x_len)
+{
+	int i;
+	unsigned int u;
+
+	for (i = 0; i < x_len; i++) {
+		u = (unsigned int) x[i];
+		h = (h ^ (u & 0xffU)) * FNV1A_PRIME;
+		h = (h ^ ((u >> 8) & 0xffU)) * FNV1A_PRIME;
+		h = (h ^ ((u >> 16) & 0xffU)) * FNV1A_PRIME;
+		h = (h ^ (u >> 24)) * FNV1A_PRIME;
+	}
+	return h;
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP NCList_fingerprint(SEXP x_start, SEXP x_end)
+{
+	int x_len;
+	const int *x_start_p, *x_end_p;
+	unsigned long long h;
+	char key[40];
+
+	x_len = check_integer_pairs(x_start, x_end,
+				    &x_start_p, &x_end_p,
+				    "start(x)", "end(x)");
+	h = fnv1a_ints(FNV1A_OFFSET_BASIS, x_start_p, x_len);
+	h = fnv1a_ints(h, x_end_p, x_len);
+	snprintf(key, sizeof(key), "%d:%016llx", x_len, h);
+	return mkString(key);
+}
+
+
 /****************************************************************************
  * pp_find_overlaps()
  */
@@ -709,6 +828,7 @@ typedef struct backpack_t {
 	int circle_len;
 	int pp_is_q;
 	IntAE *hits;
+	IntAE *gaps;
 	int *direct_out;
 
 	/* Members set by update_backpack(). */
@@ -844,15 +964,40 @@ static int is_hit(int rgid, const Backpack *backpack)
 	return backpack->is_hit_fun(rgid, backpack);
 }
 
+/* Signed gap between the x range with ID 'rgid' and the current y range.
+   This is the number of positions between the 2 ranges if they don't overlap
+   (0 if they are adjacent) and minus the width of their intersection if they
+   overlap. Note that pmax(gap, 0L) is what distance() returns. */
+static int signed_gap(int rgid, const Backpack *backpack)
+{
+	int x_start, x_end, max_start, min_end;
+
+	x_start = backpack->x_start_p[rgid];
+	x_end = backpack->x_end_p[rgid];
+	max_start = x_start >= backpack->y_start ? x_start : backpack->y_start;
+	min_end = x_end <= backpack->y_end ? x_end : backpack->y_end;
+	return max_start - min_end - 1;
+}
+
 static void report_hit(int rgid, const Backpack *backpack)
 {
 	int rgid1, q_rgid, s_rgid1, *selection_p;
+	const int *old_elts;
 
 	rgid1 = rgid + 1;  /* 1-based */
+	STATS(stats.nhit++);
 	if (backpack->select_mode == ALL_HITS) {
 		/* Report the hit. */
+		old_elts = backpack->hits->elts;
 		IntAE_insert_at(backpack->hits,
 				IntAE_get_nelt(backpack->hits), rgid1);
+		STATS(if (backpack->hits->elts != old_elts) stats.nrealloc++);
+		/* Report its gap (computed on the fly, while 'rgid' and the
+		   current y range are still hot in the cache). */
+		if (backpack->gaps != NULL)
+			IntAE_insert_at(backpack->gaps,
+					IntAE_get_nelt(backpack->gaps),
+					signed_gap(rgid, backpack));
 		return;
 	}
 	/* Update current selection if necessary. */
@@ -881,7 +1026,7 @@ static Backpack prepare_backpack(const int *x_start_p, const int *x_end_p,
 				 int overlap_type, int select_mode,
 				 int circle_len,
 				 int pp_is_q,
-				 IntAE *hits, int *direct_out)
+				 IntAE *hits, IntAE *gaps, int *direct_out)
 {
 	Backpack backpack;
 
@@ -923,6 +1068,7 @@ static Backpack prepare_backpack(const int *x_start_p, const int *x_end_p,
 	backpack.circle_len = circle_len;
 	backpack.pp_is_q = pp_is_q;
 	backpack.hits = hits;
+	backpack.gaps = gaps;
 	backpack.direct_out = direct_out;
 	return backpack;
 }
@@ -1031,12 +1177,13 @@ static void pp_find_overlaps(
 		int circle_len,
 		const void *pp, int pp_is_q,
 		GetYOverlapsFunType get_y_overlaps_fun,
-		IntAE *qh_buf, IntAE *sh_buf, int *direct_out)
+		IntAE *qh_buf, IntAE *sh_buf, IntAE *gap_buf, int *direct_out)
 {
 	const int *x_start_p, *x_end_p, *x_space_p,
 		  *y_start_p, *y_end_p, *y_space_p, *y_subset_p;
 	int y_len, backpack_select_mode,
 	    i, j, y_start, y_end, old_nhit, new_nhit, k;
+	const int *old_elts;
 	IntAE *xh_buf, *yh_buf;
 	Backpack backpack;
 
@@ -1077,7 +1224,7 @@ static void pp_find_overlaps(
 				    maxgap, minoverlap,
 				    overlap_type, backpack_select_mode,
 				    circle_len, pp_is_q,
-				    xh_buf, direct_out);
+				    xh_buf, gap_buf, direct_out);
 	for (i = 0; i < y_len; i++) {
 		j = y_subset_p == NULL ? i : y_subset_p[i];
 		y_start = y_start_p[j];
@@ -1114,8 +1261,10 @@ static void pp_find_overlaps(
 		}
 		if (select_mode != COUNT_HITS) {
 			j++;  /* 1-based */
+			old_elts = yh_buf->elts;
 			for (k = old_nhit; k < new_nhit; k++)
 				IntAE_insert_at(yh_buf, k, j);
+			STATS(if (yh_buf->elts != old_elts) stats.nrealloc++);
 			continue;
 		}
 		if (pp_is_q) {
@@ -1145,6 +1294,7 @@ static int int_bsearch(const int *subset, int subset_len, const int *base,
 {
 	int n1, n2, n, b;
 
+	STATS(stats.nbsearch++);
 	/* Check first element. */
 	n1 = 0;
 	b = base[subset[n1]];
@@ -1188,6 +1338,7 @@ static void NCList_get_y_overlaps_rec(const NCList *x_nclist,
 	int nchildren, n, rgid;
 	const NCList *child_nclist;
 
+	STATS(update_max_depth(++stats.rec_depth));
 	rgidbuf = x_nclist->rgidbuf;
 	nchildren = x_nclist->nchildren;
 	n = int_bsearch(rgidbuf, nchildren, backpack->x_end_p,
@@ -1197,6 +1348,7 @@ static void NCList_get_y_overlaps_rec(const NCList *x_nclist,
 	     n++, child_nclist++, rgidbuf++)
 	{
 		rgid = *rgidbuf;
+		STATS(stats.nvisited++);
 		if (backpack->x_start_p[rgid] > backpack->max_x_start)
 			break;
 		if (is_hit(rgid, backpack)) {
@@ -1208,6 +1360,7 @@ static void NCList_get_y_overlaps_rec(const NCList *x_nclist,
 		if (child_nclist->nchildren != 0)
 			NCList_get_y_overlaps_rec(child_nclist, backpack);
 	}
+	STATS(stats.rec_depth--);
 	return;
 }
 
@@ -1243,6 +1396,8 @@ static void NCList_get_y_overlaps(const NCList *top_nclist,
 	while (nclist != NULL) {
 		stack_elt = peek_NCListWalkingStackElt();
 		rgid = GET_RGID(stack_elt);
+		STATS(stats.nvisited++;
+		      update_max_depth(NCList_walking_stack_depth));
 		if (backpack->x_start_p[rgid] > backpack->max_x_start) {
 			/* Skip all further siblings of 'nclist'. */
 			nclist = move_to_right_uncle();
@@ -1274,6 +1429,7 @@ static void NCListAsINTSXP_get_y_overlaps_rec(const int *x_nclist,
 	const int *rgid_p, *offset_p;
 	int nchildren, n, rgid, offset;
 
+	STATS(update_max_depth(++stats.rec_depth));
 	rgid_p = NCListAsINTSXP_RGIDS(x_nclist);
 	nchildren = NCListAsINTSXP_NCHILDREN(x_nclist);
 	n = int_bsearch(rgid_p, nchildren, backpack->x_end_p,
@@ -1284,6 +1440,7 @@ static void NCListAsINTSXP_get_y_overlaps_rec(const int *x_nclist,
 	     n++, rgid_p++, offset_p++)
 	{
 		rgid = *rgid_p;
+		STATS(stats.nvisited++);
 		if (backpack->x_start_p[rgid] > backpack->max_x_start)
 			break;
 		if (is_hit(rgid, backpack)) {
@@ -1297,6 +1454,7 @@ static void NCListAsINTSXP_get_y_overlaps_rec(const int *x_nclist,
 			NCListAsINTSXP_get_y_overlaps_rec(x_nclist + offset,
 							  backpack);
 	}
+	STATS(stats.rec_depth--);
 	return;
 }
 
@@ -1314,7 +1472,7 @@ static int find_overlaps(
 		int overlap_type, int select_mode,
 		int circle_len,
 		SEXP nclist_sxp, int pp_is_q,
-		IntAE *qh_buf, IntAE *sh_buf, int *direct_out)
+		IntAE *qh_buf, IntAE *sh_buf, IntAE *gap_buf, int *direct_out)
 {
 	NCList nclist;
 	const void *pp;
@@ -1324,6 +1482,7 @@ static int find_overlaps(
 		return 0;
 	if (nclist_sxp == R_NilValue) {
 		/* On-the-fly preprocessing. */
+		STATS(start_clock());
 		pp_is_q = q_len < s_len;
 		if (pp_is_q)
 			build_NCList(&nclist, q_start_p, q_end_p,
@@ -1331,6 +1490,7 @@ static int find_overlaps(
 		else 
 			build_NCList(&nclist, s_start_p, s_end_p,
 					      s_subset_p, s_len);
+		STATS(stats.build_time += get_elapsed_time());
 		pp = &nclist;
 		get_y_overlaps_fun =
 		    (GetYOverlapsFunType) NCList_get_y_overlaps;
@@ -1339,6 +1499,7 @@ static int find_overlaps(
 		get_y_overlaps_fun =
 		    (GetYOverlapsFunType) NCListAsINTSXP_get_y_overlaps_rec;
 	}
+	STATS(start_clock());
 	pp_find_overlaps(
 		q_start_p, q_end_p, q_space_p, q_subset_p, q_len,
 		s_start_p, s_end_p, s_space_p, s_subset_p, s_len,
@@ -1346,13 +1507,84 @@ static int find_overlaps(
 		overlap_type, select_mode,
 		circle_len,
 		pp, pp_is_q, get_y_overlaps_fun,
-		qh_buf, sh_buf, direct_out);
+		qh_buf, sh_buf, gap_buf, direct_out);
+	STATS(stats.query_time += get_elapsed_time());
 	if (nclist_sxp == R_NilValue)
 		free_NCList(&nclist);
 	return pp_is_q;
 }
 
 
+/****************************************************************************
+ * _find_any_overlaps()
+ *
+ * Used by Ranges_distanceToNearest() (see nearest_methods.c).
+ * Find the overlaps of type "any" (with maxgap=0 and minoverlap=1) between
+ * the query and subject ranges. Like find_overlaps(), the shortest of query
+ * and subject is preprocessed on the fly, so 'select_mode' ARBITRARY_HIT
+ * selects the same hits as findOverlaps(). When 'select_mode' is ALL_HITS,
+ * the (1-based) hits are stored in 'qh_buf' and 'sh_buf' (which must be
+ * empty) grouped by query (but not necessarily sorted by subject within each
+ * group). Otherwise they are stored in 'direct_out' like for
+ * NCList_find_overlaps().
+ */
+
+/* Sort the hits in 'qh_buf' and 'sh_buf' by query then by subject. */
+static void sort_hits_by_query(IntAE *qh_buf, IntAE *sh_buf)
+{
+	int nhit, *order, *qh, *sh, i, retcode;
+
+	nhit = IntAE_get_nelt(qh_buf);
+	order = (int *) R_alloc((long) nhit, sizeof(int));
+	qh = (int *) R_alloc((long) nhit, sizeof(int));
+	sh = (int *) R_alloc((long) nhit, sizeof(int));
+	for (i = 0; i < nhit; i++)
+		order[i] = i;
+	retcode = sort_int_pairs(order, nhit,
+				 qh_buf->elts, sh_buf->elts,
+				 0, 0,
+				 1, NULL, NULL);
+	if (retcode != 0)
+		error("sort_hits_by_query: memory allocation failed");
+	for (i = 0; i < nhit; i++) {
+		qh[i] = qh_buf->elts[order[i]];
+		sh[i] = sh_buf->elts[order[i]];
+	}
+	memcpy(qh_buf->elts, qh, sizeof(int) * nhit);
+	memcpy(sh_buf->elts, sh, sizeof(int) * nhit);
+	return;
+}
+
+void _find_any_overlaps(
+		const int *q_start_p, const int *q_end_p, int q_len,
+		const int *s_start_p, const int *s_end_p, int s_len,
+		int select_mode,
+		IntAE *qh_buf, IntAE *sh_buf, int *direct_out)
+{
+	NCList nclist;
+	int pp_is_q;
+
+	if (q_len == 0 || s_len == 0)
+		return;
+	pp_is_q = q_len < s_len;
+	if (pp_is_q)
+		build_NCList(&nclist, q_start_p, q_end_p, NULL, q_len);
+	else
+		build_NCList(&nclist, s_start_p, s_end_p, NULL, s_len);
+	pp_find_overlaps(
+		q_start_p, q_end_p, NULL, NULL, q_len,
+		s_start_p, s_end_p, NULL, NULL, s_len,
+		0, 1, TYPE_ANY, select_mode, NA_INTEGER,
+		&nclist, pp_is_q, (GetYOverlapsFunType) NCList_get_y_overlaps,
+		qh_buf, sh_buf, NULL, direct_out);
+	free_NCList(&nclist);
+	/* When the query is preprocessed, the hits are grouped by subject. */
+	if (pp_is_q && select_mode == ALL_HITS)
+		sort_hits_by_query(qh_buf, sh_buf);
+	return;
+}
+
+
 /****************************************************************************
  * Helper functions shared by NCList_find_overlaps() and
  * NCList_find_overlaps_in_groups()
@@ -1457,20 +1689,28 @@ static SEXP new_direct_out(int q_len, int select_mode)
  *   type:           See get_overlap_type() C function.
  *   select:         See _get_select_mode() C function in S4Vectors.
  *   circle_length:  A single positive integer or NA_INTEGER.
+ *   with_gap:       TRUE or FALSE. If TRUE, 'select' must be "all" and
+ *                   'circle_length' must be NA, and the signed gap between
+ *                   the query and subject ranges of each hit (see
+ *                   signed_gap() above) is computed during the traversal.
+ *                   The hits are then returned as a list of 3 parallel
+ *                   integer vectors (query hits, subject hits, and gaps)
+ *                   instead of a Hits object. Note that these hits are not
+ *                   necessarily sorted by query.
  */
 SEXP NCList_find_overlaps(
 		SEXP q_start, SEXP q_end,
 		SEXP s_start, SEXP s_end,
 		SEXP nclist, SEXP nclist_is_q,
 		SEXP maxgap, SEXP minoverlap, SEXP type, SEXP select,
-		SEXP circle_length)
+		SEXP circle_length, SEXP with_gap)
 {
 	int q_len, s_len,
 	    maxgap0, minoverlap0, overlap_type, select_mode, circle_len,
-	    *direct_out, pp_is_q;
+	    with_gap0, *direct_out, pp_is_q;
 	const int *q_start_p, *q_end_p, *s_start_p, *s_end_p;
-	IntAE *qh_buf, *sh_buf;
-	SEXP ans;
+	IntAE *qh_buf, *sh_buf, *gap_buf;
+	SEXP ans, ans_elt;
 
 	q_len = check_integer_pairs(q_start, q_end,
 				    &q_start_p, &q_end_p,
@@ -1483,27 +1723,48 @@ SEXP NCList_find_overlaps(
 	minoverlap0 = get_minoverlap0(minoverlap, maxgap0, overlap_type);
 	select_mode = get_select_mode(select);
 	circle_len = get_circle_length(circle_length);
+	if (!IS_LOGICAL(with_gap) || LENGTH(with_gap) != 1
+	 || LOGICAL(with_gap)[0] == NA_LOGICAL)
+		error("'with_gap' must be TRUE or FALSE");
+	with_gap0 = LOGICAL(with_gap)[0];
+	if (with_gap0 && select_mode != ALL_HITS)
+		error("'with_gap' can only be TRUE when 'select' is \"all\"");
+	if (with_gap0 && circle_len != NA_INTEGER)
+		error("'with_gap' can only be TRUE when 'circle_length' is NA");
 
 	qh_buf = new_IntAE(0, 0, 0);
 	sh_buf = new_IntAE(0, 0, 0);
+	gap_buf = with_gap0 ? new_IntAE(0, 0, 0) : NULL;
 	direct_out = NULL;
 	if (select_mode != ALL_HITS) {
 		PROTECT(ans = new_direct_out(q_len, select_mode));
 		direct_out = INTEGER(ans);
 	}
-	//init_clock("find_overlaps: T2 = ");
+	STATS(reset_stats());
 	pp_is_q = find_overlaps(
 		q_start_p, q_end_p, NULL, NULL, q_len,
 		s_start_p, s_end_p, NULL, NULL, s_len,
 		maxgap0, minoverlap0, overlap_type,
 		select_mode, circle_len,
 		nclist, LOGICAL(nclist_is_q)[0],
-		qh_buf, sh_buf, direct_out);
-	//print_elapsed_time();
+		qh_buf, sh_buf, gap_buf, direct_out);
 	if (select_mode != ALL_HITS) {
 		UNPROTECT(1);
 		return ans;
 	}
+	if (with_gap0) {
+		PROTECT(ans = NEW_LIST(3));
+		PROTECT(ans_elt = new_INTEGER_from_IntAE(qh_buf));
+		SET_VECTOR_ELT(ans, 0, ans_elt);
+		UNPROTECT(1);
+		PROTECT(ans_elt = new_INTEGER_from_IntAE(sh_buf));
+		SET_VECTOR_ELT(ans, 1, ans_elt);
+		UNPROTECT(1);
+		PROTECT(ans_elt = new_INTEGER_from_IntAE(gap_buf));
+		SET_VECTOR_ELT(ans, 2, ans_elt);
+		UNPROTECT(2);
+		return ans;
+	}
 	return new_Hits(qh_buf->elts, sh_buf->elts, IntAE_get_nelt(qh_buf),
 			q_len, s_len, !pp_is_q);
 }
@@ -1592,6 +1853,7 @@ SEXP NCList_find_overlaps_in_groups(
 		PROTECT(ans = new_direct_out(q_len, select_mode));
 		direct_out = INTEGER(ans);
 	}
+	STATS(reset_stats());
 	NG = NG1 <= NG2 ? NG1 : NG2;
 	for (i = 0; i < NG; i++) {
 		qi_group_holder = _get_elt_from_CompressedIntsList_holder(
@@ -1608,7 +1870,7 @@ SEXP NCList_find_overlaps_in_groups(
 			maxgap0, minoverlap0, overlap_type,
 			select_mode, INTEGER(circle_length)[i],
 			VECTOR_ELT(nclists, i), LOGICAL(nclist_is_q)[i],
-			qh_buf, sh_buf, direct_out);
+			qh_buf, sh_buf, NULL, direct_out);
 	}
 	if (select_mode != ALL_HITS) {
 		UNPROTECT(1);
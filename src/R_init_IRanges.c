@@ -27,12 +27,19 @@ static const R_CallMethodDef callMethods[] = {
 	CALLMETHOD_DEF(H2LGrouping_vmembers, 2),
 
 /* RleViews_utils.c */
-	CALLMETHOD_DEF(RleViews_viewMins, 2),
-	CALLMETHOD_DEF(RleViews_viewMaxs, 2),
-	CALLMETHOD_DEF(RleViews_viewSums, 2),
-	CALLMETHOD_DEF(RleViews_viewMeans, 2),
-	CALLMETHOD_DEF(RleViews_viewWhichMins, 2),
-	CALLMETHOD_DEF(RleViews_viewWhichMaxs, 2),
+	CALLMETHOD_DEF(RleViews_viewMins, 3),
+	CALLMETHOD_DEF(RleViews_viewMaxs, 3),
+	CALLMETHOD_DEF(RleViews_viewSums, 3),
+	CALLMETHOD_DEF(RleViews_viewMeans, 3),
+	CALLMETHOD_DEF(RleViews_viewWhichMins, 3),
+	CALLMETHOD_DEF(RleViews_viewWhichMaxs, 3),
+	CALLMETHOD_DEF(RleViews_viewSummaries, 4),
+	CALLMETHOD_DEF(RleViewsList_viewSummaries, 4),
+	CALLMETHOD_DEF(vector_viewSummaries, 6),
+	CALLMETHOD_DEF(RleViews_viewMedians, 2),
+	CALLMETHOD_DEF(RleViews_viewQuantiles, 3),
+	CALLMETHOD_DEF(RleViews_viewVars, 2),
+	CALLMETHOD_DEF(RleViews_viewCountsAbove, 3),
 
 /* SimpleIRangesList_class.c */
 	CALLMETHOD_DEF(SimpleIRangesList_isNormal, 2),
@@ -55,17 +62,34 @@ static const R_CallMethodDef callMethods[] = {
 
 /* coverage_methods.c */
 	CALLMETHOD_DEF(IRanges_coverage, 6),
-	CALLMETHOD_DEF(CompressedIRangesList_coverage, 6),
+	CALLMETHOD_DEF(IRanges_coverage_costs, 5),
+	CALLMETHOD_DEF(coverage_set_cost_scales, 1),
+	CALLMETHOD_DEF(CompressedIRangesList_coverage, 7),
+	CALLMETHOD_DEF(CoverageAcc_new, 1),
+	CALLMETHOD_DEF(CoverageAcc_free, 1),
+	CALLMETHOD_DEF(CoverageAcc_add, 4),
+	CALLMETHOD_DEF(CoverageAcc_as_Rle, 1),
+	CALLMETHOD_DEF(IRanges_coverage_islands, 10),
+	CALLMETHOD_DEF(Rle_slice, 7),
+	CALLMETHOD_DEF(RleList_slice, 7),
+	CALLMETHOD_DEF(IRanges_binned_coverage, 7),
+	CALLMETHOD_DEF(CompressedIRangesList_coverage_matrix, 4),
 
 /* NCList.c */
+	CALLMETHOD_DEF(NCList_enable_stats, 1),
+	CALLMETHOD_DEF(NCList_get_stats, 0),
 	CALLMETHOD_DEF(NCList_new, 0),
 	CALLMETHOD_DEF(NCList_free, 1),
 	CALLMETHOD_DEF(NCList_build, 4),
 	CALLMETHOD_DEF(new_NCListAsINTSXP_from_NCList, 1),
 	CALLMETHOD_DEF(NCListAsINTSXP_print, 3),
-	CALLMETHOD_DEF(NCList_find_overlaps, 11),
+	CALLMETHOD_DEF(NCList_fingerprint, 2),
+	CALLMETHOD_DEF(NCList_find_overlaps, 12),
 	CALLMETHOD_DEF(NCList_find_overlaps_in_groups, 15),
 
+/* nearest_methods.c */
+	CALLMETHOD_DEF(Ranges_distanceToNearest, 6),
+
 /* CompressedAtomicList_utils.c */
 	CALLMETHOD_DEF(CompressedLogicalList_sum, 2),
 	CALLMETHOD_DEF(CompressedIntegerList_sum, 2),
@@ -1,567 +1,1832 @@
 #include "IRanges.h"
+#include "S4Vectors_interface.h"
+
 #include <R_ext/Arith.h>
 #include <R_ext/Utils.h>
 #include <limits.h>
+#include <math.h> /* for log2() */
+#include <stdlib.h> /* for malloc(), free() */
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define R_INT_MIN	(1+INT_MIN)
 
-/*
- * --- .Call ENTRY POINT ---
+/****************************************************************************
+ * Indexes on the runs of an Rle.
+ *
+ * The view summaries below walk the runs covered by each view. The views
+ * are processed by increasing start (the summaries are still written in
+ * the original order of the views) and the run containing the start of a
+ * view is found by binary search when it's not the current run or the next
+ * one, so the cost of the walk doesn't depend on the order of the views or
+ * on the gaps between them. When the views are long or overlap a lot
+ * (e.g. 1M promoter windows on a coverage vector) it's cheaper to answer
+ * them with an index on the runs of the subject: a prefix-sum index for
+ * viewSums() and viewMeans() (on integer Rles only), and a range
+ * minimum/maximum query (RMQ) index for viewMins(), viewMaxs(),
+ * viewWhichMins(), and viewWhichMaxs().
+ *
+ * The 'use_index' argument of these .Call entry points is TRUE (always use
+ * the index), FALSE (always walk the runs), or NA (use the index when it's
+ * estimated to be cheaper). It's ignored when there's no index for the
+ * summary and the type of the values.
  */
-SEXP RleViews_viewMins(SEXP x, SEXP na_rm)
+
+/* An index is used when the estimated cost of walking the runs is at least
+   INDEX_MIN_GAIN times the cost of building and querying it. */
+#define INDEX_MIN_GAIN	2.0
+
+static void check_use_index(SEXP use_index)
 {
-	char type = '?';
-	int i, start, width, ans_len, index, lower_run, upper_run, upper_bound;
-	int max_index, *lengths_elt;
-	SEXP ans, subject, values, lengths, ranges, names;
-	IRanges_holder ranges_holder;
+	if (!IS_LOGICAL(use_index) || LENGTH(use_index) != 1)
+		error("'use_index' must be TRUE, FALSE, or NA");
+	return;
+}
 
-	subject = GET_SLOT(x, install("subject"));
-	values = GET_SLOT(subject, install("values"));
-	lengths = GET_SLOT(subject, install("lengths"));
-	ranges = GET_SLOT(x, install("ranges"));
-	ranges_holder = _hold_IRanges(ranges);
-	ans_len = _get_length_from_IRanges_holder(&ranges_holder);
+/* Returns the index of the run containing position 'pos' (1-based).
+   'run_ends' contains the (sorted) end positions of the runs. */
+static int find_run(const int *run_ends, int nrun, int pos)
+{
+	int lo, hi, mid;
 
-	ans = R_NilValue;
-	switch (TYPEOF(values)) {
-    case LGLSXP:
-    case INTSXP:
-		type = 'i';
-		PROTECT(ans = NEW_INTEGER(ans_len));
-		break;
-    case REALSXP:
-		type = 'r';
-		PROTECT(ans = NEW_NUMERIC(ans_len));
-		break;
-    default:
-		error("Rle must contain either 'integer' or 'numeric' values");
-    }
+	lo = 0;
+	hi = nrun - 1;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (run_ends[mid] < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
 
-	if (!IS_LOGICAL(na_rm) || LENGTH(na_rm) != 1 || LOGICAL(na_rm)[0] == NA_LOGICAL)
-		error("'na.rm' must be TRUE or FALSE");
+/* Returns NULL if the views are sorted by start. Otherwise returns the
+   (0-based) indices of the views in order of increasing start. */
+static const int *get_views_order(const IRanges_holder *ranges_holder)
+{
+	int nview, i, *starts, *order;
+
+	nview = _get_length_from_IRanges_holder(ranges_holder);
+	for (i = 1; i < nview; i++)
+		if (_get_start_elt_from_IRanges_holder(ranges_holder, i) <
+		    _get_start_elt_from_IRanges_holder(ranges_holder, i - 1))
+			break;
+	if (i >= nview)
+		return NULL;
+	starts = (int *) R_alloc(nview, sizeof(int));
+	for (i = 0; i < nview; i++)
+		starts[i] = _get_start_elt_from_IRanges_holder(ranges_holder,
+							       i);
+	order = (int *) R_alloc(nview, sizeof(int));
+	get_order_of_int_array(starts, nview, 0, order, 0);
+	return order;
+}
+
+static int *get_run_ends(SEXP lengths)
+{
+	int nrun, k, *run_ends;
+
+	nrun = LENGTH(lengths);
+	run_ends = (int *) R_alloc(nrun, sizeof(int));
+	for (k = 0; k < nrun; k++)
+		run_ends[k] = (k == 0 ? 0 : run_ends[k - 1]) +
+			      INTEGER(lengths)[k];
+	return run_ends;
+}
+
+/* The cost of walking the runs for all the views is estimated by the total
+   nb of positions the walk goes thru (the views themselves plus the jumps
+   between the starts of the views, which are visited by increasing start)
+   times the average nb of runs per position. A jump costs at most a binary
+   search on the runs. */
+static double estimate_walk_cost(SEXP lengths,
+		const IRanges_holder *ranges_holder)
+{
+	int nrun, ans_len, i, k, start, min_start, max_start;
+	double subject_len, walked_len, jumps_cost;
+
+	nrun = LENGTH(lengths);
+	ans_len = _get_length_from_IRanges_holder(ranges_holder);
+	if (nrun == 0 || ans_len == 0)
+		return 0.0;
+	subject_len = 0.0;
+	for (k = 0; k < nrun; k++)
+		subject_len += INTEGER(lengths)[k];
+	walked_len = 0.0;
+	min_start = max_start = 1;
+	for (i = 0; i < ans_len; i++) {
+		start = _get_start_elt_from_IRanges_holder(ranges_holder, i);
+		walked_len += _get_width_elt_from_IRanges_holder(
+					ranges_holder, i);
+		if (start < min_start)
+			min_start = start;
+		if (start > max_start)
+			max_start = start;
+	}
+	jumps_cost = ((double) max_start - min_start) * nrun / subject_len;
+	if (jumps_cost > ans_len * log2(nrun + 1.0))
+		jumps_cost = ans_len * log2(nrun + 1.0);
+	return walked_len * nrun / subject_len + jumps_cost + ans_len;
+}
+
+
+/****************************************************************************
+ * A range minimum/maximum query (RMQ) index on the runs of an Rle.
+ *
+ * The runs are grouped in blocks of RMQ_BLOCK_LEN runs and a sparse table
+ * stores the best run (i.e. the run with the min or max value) of every
+ * range of 2^j consecutive blocks. A query scans the runs of the 2 blocks
+ * that are partially covered and looks up the blocks in between in the
+ * table. The NA runs always lose against the other runs and the ties are
+ * won by the leftmost run, which is what the walk in the view summaries
+ * does.
+ *
+ * The index is built by the .Call entry point that uses it and freed
+ * before it returns (it's held by an external pointer with a finalizer in
+ * case of an error or user interrupt). Only the table that is needed (min
+ * or max) is built.
+ */
+
+#define RMQ_BLOCK_LEN	32
+
+typedef struct rle_rmq {
+	char type;
+	int nrun;
+	const int *ivalues;	/* type 'i' */
+	const double *rvalues;	/* type 'r' */
+	int *run_ends;
+	int *next_na;	/* index of the 1st NA run >= k (nrun if none) */
+	int nblock, nlevel;
+	int *tables[2];	/* min table and max table (NULL until needed) */
+} RleRMQ;
+
+static int rmq_is_na(const RleRMQ *rmq, int k)
+{
+	if (rmq->type == 'i')
+		return rmq->ivalues[k] == NA_INTEGER;
+	return ISNAN(rmq->rvalues[k]);
+}
+
+/* Is run 'k' strictly better than run 'j'? */
+static int rmq_is_better(const RleRMQ *rmq, int is_max, int k, int j)
+{
+	if (rmq_is_na(rmq, k))
+		return 0;
+	if (rmq_is_na(rmq, j))
+		return 1;
+	if (rmq->type == 'i')
+		return is_max ? rmq->ivalues[k] > rmq->ivalues[j]
+			      : rmq->ivalues[k] < rmq->ivalues[j];
+	return is_max ? rmq->rvalues[k] > rmq->rvalues[j]
+		      : rmq->rvalues[k] < rmq->rvalues[j];
+}
+
+static int rmq_scan(const RleRMQ *rmq, int is_max, int from, int to)
+{
+	int best, k;
+
+	best = from;
+	for (k = from + 1; k <= to; k++)
+		if (rmq_is_better(rmq, is_max, k, best))
+			best = k;
+	return best;
+}
+
+static int *build_rmq_table(const RleRMQ *rmq, int is_max)
+{
+	int *table, *prev_level, *level, b, j, to, half;
+
+	table = (int *) malloc(sizeof(int) * (size_t) rmq->nlevel *
+					     (size_t) rmq->nblock);
+	if (table == NULL)
+		error("IRanges internal error in build_rmq_table(): "
+		      "memory allocation failed");
+	for (b = 0; b < rmq->nblock; b++) {
+		to = (b + 1) * RMQ_BLOCK_LEN - 1;
+		if (to >= rmq->nrun)
+			to = rmq->nrun - 1;
+		table[b] = rmq_scan(rmq, is_max, b * RMQ_BLOCK_LEN, to);
+	}
+	for (j = 1, half = 1; j < rmq->nlevel; j++, half *= 2) {
+		prev_level = table + (size_t) (j - 1) * rmq->nblock;
+		level = prev_level + rmq->nblock;
+		for (b = 0; b + 2 * half <= rmq->nblock; b++) {
+			level[b] = prev_level[b];
+			if (rmq_is_better(rmq, is_max, prev_level[b + half],
+						       level[b]))
+				level[b] = prev_level[b + half];
+		}
+	}
+	return table;
+}
+
+/* Returns the best run in runs 'k1' to 'k2' (k1 <= k2). */
+static int rmq_query(RleRMQ *rmq, int is_max, int k1, int k2)
+{
+	int b1, b2, best, k, j, nblock, *level;
+
+	if (rmq->tables[is_max] == NULL)
+		rmq->tables[is_max] = build_rmq_table(rmq, is_max);
+	b1 = k1 / RMQ_BLOCK_LEN;
+	b2 = k2 / RMQ_BLOCK_LEN;
+	if (b1 == b2)
+		return rmq_scan(rmq, is_max, k1, k2);
+	best = rmq_scan(rmq, is_max, k1, (b1 + 1) * RMQ_BLOCK_LEN - 1);
+	nblock = b2 - b1 - 1;
+	if (nblock != 0) {
+		for (j = 0; (2 << j) <= nblock; j++) {}
+		level = rmq->tables[is_max] + (size_t) j * rmq->nblock;
+		k = level[b1 + 1];
+		if (rmq_is_better(rmq, is_max, k, best))
+			best = k;
+		k = level[b2 - (1 << j)];
+		if (rmq_is_better(rmq, is_max, k, best))
+			best = k;
+	}
+	k = rmq_scan(rmq, is_max, b2 * RMQ_BLOCK_LEN, k2);
+	if (rmq_is_better(rmq, is_max, k, best))
+		best = k;
+	return best;
+}
+
+static void free_rmq(SEXP rmq_xp)
+{
+	RleRMQ *rmq;
+
+	rmq = (RleRMQ *) R_ExternalPtrAddr(rmq_xp);
+	if (rmq == NULL)
+		return;
+	free(rmq->run_ends);
+	free(rmq->next_na);
+	free(rmq->tables[0]);
+	free(rmq->tables[1]);
+	free(rmq);
+	R_ClearExternalPtr(rmq_xp);
+	return;
+}
 
-	lengths_elt = INTEGER(lengths);
-	max_index = LENGTH(lengths) - 1;
-	index = 0;
-	upper_run = *lengths_elt;
+static RleRMQ *new_rmq(char type, SEXP values, SEXP lengths)
+{
+	RleRMQ *rmq;
+	int nrun, k;
+
+	nrun = LENGTH(lengths);
+	rmq = (RleRMQ *) malloc(sizeof(RleRMQ));
+	if (rmq == NULL)
+		error("IRanges internal error in new_rmq(): "
+		      "memory allocation failed");
+	rmq->type = type;
+	rmq->nrun = nrun;
+	rmq->ivalues = type == 'i' ? INTEGER(values) : NULL;
+	rmq->rvalues = type == 'r' ? REAL(values) : NULL;
+	/* + 1 so we never call malloc(0) */
+	rmq->run_ends = (int *) malloc(sizeof(int) * ((size_t) nrun + 1));
+	rmq->next_na = (int *) malloc(sizeof(int) * ((size_t) nrun + 1));
+	rmq->tables[0] = rmq->tables[1] = NULL;
+	if (rmq->run_ends == NULL || rmq->next_na == NULL) {
+		free(rmq->run_ends);
+		free(rmq->next_na);
+		free(rmq);
+		error("IRanges internal error in new_rmq(): "
+		      "memory allocation failed");
+	}
+	memcpy(rmq->run_ends, get_run_ends(lengths), sizeof(int) * nrun);
+	rmq->next_na[nrun] = nrun;
+	for (k = nrun - 1; k >= 0; k--)
+		rmq->next_na[k] = rmq_is_na(rmq, k) ? k : rmq->next_na[k + 1];
+	rmq->nblock = (nrun + RMQ_BLOCK_LEN - 1) / RMQ_BLOCK_LEN;
+	for (rmq->nlevel = 1; (2 << (rmq->nlevel - 1)) <= rmq->nblock;
+	     rmq->nlevel++) {}
+	return rmq;
+}
+
+/* Returns an external pointer to a new index. */
+static SEXP new_rmq_xp(char type, SEXP values, SEXP lengths)
+{
+	SEXP rmq_xp;
+
+	PROTECT(rmq_xp = R_MakeExternalPtr(NULL, R_NilValue, R_NilValue));
+	R_RegisterCFinalizerEx(rmq_xp, free_rmq, TRUE);
+	R_SetExternalPtrAddr(rmq_xp, new_rmq(type, values, lengths));
+	UNPROTECT(1);
+	return rmq_xp;
+}
+
+/* Building the index costs a pass over the runs and each view costs 2
+   binary searches plus the scan of up to 2 blocks. */
+static int use_rmq(SEXP use_index, SEXP lengths,
+		const IRanges_holder *ranges_holder)
+{
+	int nrun, ans_len;
+	double walk_cost, index_cost;
+
+	if (LOGICAL(use_index)[0] != NA_LOGICAL)
+		return LOGICAL(use_index)[0];
+	walk_cost = estimate_walk_cost(lengths, ranges_holder);
+	nrun = LENGTH(lengths);
+	ans_len = _get_length_from_IRanges_holder(ranges_holder);
+	index_cost = ans_len * (2.0 * log2(nrun + 1.0) + 2 * RMQ_BLOCK_LEN) +
+		     2.0 * nrun;
+	return walk_cost >= INDEX_MIN_GAIN * index_cost;
+}
+
+/* Fills 'ans' with the min or max (if 'is_max') of each view, or with its
+   position if 'which'. */
+static void rmq_view_extremes(char type, SEXP values, SEXP lengths,
+		const IRanges_holder *ranges_holder, int narm,
+		int is_max, int which, SEXP ans)
+{
+	SEXP rmq_xp;
+	RleRMQ *rmq;
+	int ans_len, i, start, width, k1, k2, k, pos, is_init;
+
+	PROTECT(rmq_xp = new_rmq_xp(type, values, lengths));
+	rmq = (RleRMQ *) R_ExternalPtrAddr(rmq_xp);
+	ans_len = _get_length_from_IRanges_holder(ranges_holder);
 	for (i = 0; i < ans_len; i++) {
 		if (i % 100000 == 99999)
 			R_CheckUserInterrupt();
-		start = _get_start_elt_from_IRanges_holder(&ranges_holder, i);
-		width = _get_width_elt_from_IRanges_holder(&ranges_holder, i);
-		if (type == 'i') {
-			INTEGER(ans)[i] = INT_MAX;
-		} else if (type == 'r') {
-			REAL(ans)[i] = R_PosInf;
-		}
+		start = _get_start_elt_from_IRanges_holder(ranges_holder, i);
+		width = _get_width_elt_from_IRanges_holder(ranges_holder, i);
+		k = -1;
 		if (width > 0) {
-			while (index > 0 && upper_run > start) {
-				upper_run -= *lengths_elt;
-				lengths_elt--;
-				index--;
-			}
-			while (upper_run < start) {
-				lengths_elt++;
-				index++;
-				upper_run += *lengths_elt;
-			}
-			lower_run = upper_run - *lengths_elt + 1;
-			upper_bound = start + width - 1;
-			if (type == 'i') {
-				while (lower_run <= upper_bound) {
-					if (INTEGER(values)[index] == NA_INTEGER) {
-						if (!LOGICAL(na_rm)[0]) {
-							INTEGER(ans)[i] = NA_INTEGER;
-							break;
-						}
-					} else if (INTEGER(values)[index] < INTEGER(ans)[i]) {
-						INTEGER(ans)[i] = INTEGER(values)[index];
-					}
-					if (index < max_index) {
-						lengths_elt++;
-						index++;
-						lower_run = upper_run + 1;
-						upper_run += *lengths_elt;
-					} else {
-						break;
-					}
-				}
-			} else if (type == 'r') {
-				while (lower_run <= upper_bound) {
-					if (ISNAN(REAL(values)[index])) {
-						if (!LOGICAL(na_rm)[0]) {
-							REAL(ans)[i] = NA_REAL;
-							break;
-						}
-					} else if (REAL(values)[index] < REAL(ans)[i]) {
-						REAL(ans)[i] = REAL(values)[index];
-					}
-					if (index < max_index) {
-						lengths_elt++;
-						index++;
-						lower_run = upper_run + 1;
-						upper_run += *lengths_elt;
-					} else {
-						break;
-					}
+			k1 = find_run(rmq->run_ends, rmq->nrun, start);
+			k2 = find_run(rmq->run_ends, rmq->nrun,
+				      start + width - 1);
+			if (!narm && rmq->next_na[k1] <= k2) {
+				/* The walk stops at the 1st NA. */
+				if (!which) {
+					if (type == 'i')
+						INTEGER(ans)[i] = NA_INTEGER;
+					else
+						REAL(ans)[i] = NA_REAL;
+					continue;
 				}
+				k2 = rmq->next_na[k1] - 1;
 			}
+			if (k1 <= k2)
+				k = rmq_query(rmq, is_max, k1, k2);
+			if (k != -1 && rmq_is_na(rmq, k))
+				k = -1;
+		}
+		/* Like the walk, we start from INT_MAX/+Inf (min) or
+		   R_INT_MIN/-Inf (max) and only record strictly better
+		   values. */
+		if (type == 'i') {
+			is_init = k == -1 ||
+				  rmq->ivalues[k] == (is_max ? R_INT_MIN
+							     : INT_MAX);
+		} else {
+			is_init = k == -1 ||
+				  rmq->rvalues[k] == (is_max ? R_NegInf
+							     : R_PosInf);
+		}
+		if (which) {
+			if (is_init) {
+				INTEGER(ans)[i] = NA_INTEGER;
+				continue;
+			}
+			pos = rmq->run_ends[k] - INTEGER(lengths)[k] + 1;
+			INTEGER(ans)[i] = pos > start ? pos : start;
+		} else if (type == 'i') {
+			if (k == -1)
+				INTEGER(ans)[i] = is_max ? R_INT_MIN : INT_MAX;
+			else
+				INTEGER(ans)[i] = rmq->ivalues[k];
+		} else {
+			if (k == -1)
+				REAL(ans)[i] = is_max ? R_NegInf : R_PosInf;
+			else
+				REAL(ans)[i] = rmq->rvalues[k];
 		}
 	}
-	PROTECT(names = duplicate(_get_IRanges_names(ranges)));
-	SET_NAMES(ans, names);
-	UNPROTECT(2);
-	return ans;
+	free_rmq(rmq_xp);
+	UNPROTECT(1);
+	return;
 }
 
-/*
- * --- .Call ENTRY POINT ---
+
+/****************************************************************************
+ * A prefix-sum index on the runs of an Rle.
+ *
+ * The cumulative sums of the runs are computed once and each view is
+ * answered with 2 binary searches and a correction for the partially
+ * covered runs at its ends.
+ *
+ * The index is only built on integer (or logical) Rles. The cumulative sums
+ * of doubles can't be used: the difference of 2 of them would lose the
+ * precision of a view to the values that precede it in the Rle (e.g. the
+ * sum of a view of small values after a long run of large values).
  */
-SEXP RleViews_viewMaxs(SEXP x, SEXP na_rm)
+
+typedef struct runs_index {
+	int nrun;
+	const int *lengths;
+	const int *values;
+	int *run_ends;
+	/* The k-th elements of the arrays below are the totals for runs 0 to
+	   k-1. They have nrun + 1 elements. */
+	long long int *sums;	/* sum of the non-NA values */
+	int *nas;		/* nb of NA positions */
+} RunsIndex;
+
+typedef struct view_totals {
+	long long int isum;
+	int nna;
+} ViewTotals;
+
+static RunsIndex build_runs_index(SEXP values, SEXP lengths)
+{
+	RunsIndex index;
+	int k, len, v;
+
+	index.nrun = LENGTH(lengths);
+	index.lengths = INTEGER(lengths);
+	index.values = INTEGER(values);
+	index.run_ends = get_run_ends(lengths);
+	index.sums = (long long int *)
+		R_alloc(index.nrun + 1, sizeof(long long int));
+	index.nas = (int *) R_alloc(index.nrun + 1, sizeof(int));
+	index.sums[0] = 0;
+	index.nas[0] = 0;
+	for (k = 0; k < index.nrun; k++) {
+		len = index.lengths[k];
+		v = index.values[k];
+		index.nas[k + 1] = index.nas[k] + (v == NA_INTEGER ? len : 0);
+		index.sums[k + 1] = index.sums[k] +
+			(v == NA_INTEGER ? 0 : (long long int) v * len);
+	}
+	return index;
+}
+
+/* Removes the contribution of 'npos' positions of run 'k' from 'totals'. */
+static void remove_run_positions(const RunsIndex *index, int k, int npos,
+		ViewTotals *totals)
+{
+	if (index->values[k] == NA_INTEGER)
+		totals->nna -= npos;
+	else
+		totals->isum -= (long long int) index->values[k] * npos;
+}
+
+/* 'width' must be > 0 and the view must be within the Rle. */
+static ViewTotals get_view_totals(const RunsIndex *index,
+		int start, int width)
+{
+	ViewTotals totals;
+	int end, k1, k2;
+
+	end = start + width - 1;
+	k1 = find_run(index->run_ends, index->nrun, start);
+	k2 = find_run(index->run_ends, index->nrun, end);
+	totals.isum = index->sums[k2 + 1] - index->sums[k1];
+	totals.nna = index->nas[k2 + 1] - index->nas[k1];
+	/* Partially covered runs at the ends of the view. */
+	remove_run_positions(index, k1,
+		start - (index->run_ends[k1] - index->lengths[k1] + 1),
+		&totals);
+	remove_run_positions(index, k2, index->run_ends[k2] - end, &totals);
+	return totals;
+}
+
+/* Building the index costs a pass over the runs and each view costs 2
+   binary searches. */
+static int use_runs_index(SEXP use_index, SEXP lengths,
+		const IRanges_holder *ranges_holder)
+{
+	int nrun, ans_len;
+	double walk_cost, index_cost;
+
+	if (LOGICAL(use_index)[0] != NA_LOGICAL)
+		return LOGICAL(use_index)[0];
+	walk_cost = estimate_walk_cost(lengths, ranges_holder);
+	nrun = LENGTH(lengths);
+	ans_len = _get_length_from_IRanges_holder(ranges_holder);
+	index_cost = nrun + 2.0 * ans_len * log2(nrun + 1.0);
+	return walk_cost >= INDEX_MIN_GAIN * index_cost;
+}
+
+static void runs_index_view_sums(SEXP values, SEXP lengths,
+		const IRanges_holder *ranges_holder, int narm, SEXP ans)
+{
+	RunsIndex index;
+	ViewTotals totals;
+	int ans_len, i, width;
+
+	index = build_runs_index(values, lengths);
+	ans_len = _get_length_from_IRanges_holder(ranges_holder);
+	for (i = 0; i < ans_len; i++) {
+		width = _get_width_elt_from_IRanges_holder(ranges_holder, i);
+		if (width <= 0) {
+			INTEGER(ans)[i] = 0;
+			continue;
+		}
+		totals = get_view_totals(&index,
+			_get_start_elt_from_IRanges_holder(ranges_holder, i),
+			width);
+		if (totals.nna != 0 && !narm) {
+			INTEGER(ans)[i] = NA_INTEGER;
+			continue;
+		}
+		if (totals.isum > INT_MAX || totals.isum < R_INT_MIN)
+			error("Integer overflow");
+		INTEGER(ans)[i] = (int) totals.isum;
+	}
+	return;
+}
+
+static void runs_index_view_means(SEXP values, SEXP lengths,
+		const IRanges_holder *ranges_holder, int narm, SEXP ans)
 {
-	char type = '?';
-	int i, start, width, ans_len, index, lower_run, upper_run, upper_bound;
-	int max_index, *lengths_elt;
-	SEXP ans, subject, values, lengths, ranges, names;
+	RunsIndex index;
+	ViewTotals totals;
+	int ans_len, i, width, n;
+
+	index = build_runs_index(values, lengths);
+	ans_len = _get_length_from_IRanges_holder(ranges_holder);
+	for (i = 0; i < ans_len; i++) {
+		width = _get_width_elt_from_IRanges_holder(ranges_holder, i);
+		if (width <= 0) {
+			REAL(ans)[i] = R_NaN;
+			continue;
+		}
+		totals = get_view_totals(&index,
+			_get_start_elt_from_IRanges_holder(ranges_holder, i),
+			width);
+		if (totals.nna != 0 && !narm) {
+			REAL(ans)[i] = NA_REAL;
+			continue;
+		}
+		n = width - totals.nna;
+		REAL(ans)[i] = n == 0 ? R_NaN : (double) totals.isum / n;
+	}
+	return;
+}
+
+
+/****************************************************************************
+ * viewSummaries(): several summaries of each view in a single walk.
+ *
+ * The summaries are the same as the ones returned by viewMins(),
+ * viewMaxs(), viewSums(), viewMeans(), viewWhichMins(), and
+ * viewWhichMaxs() (in particular for the views with NAs or of width 0),
+ * plus the nb of non-zero positions ("count.nonzero"). Like trim(), the
+ * views are clipped to the bounds of the subject.
+ *
+ * "which.min.end" and "which.max.end" are the ends of the runs that start
+ * at "which.min" and "which.max", clipped to the view. They're only used
+ * by viewRangeMins() and viewRangeMaxs().
+ *
+ * The walk only uses the C-level data of the Rle and of the views (no R
+ * API) so it can be run concurrently on the views of the elements of an
+ * RleViewsList, and on chunks of consecutive views of the same Rle (the
+ * summary of a view doesn't depend on the chunk it belongs to so the
+ * result is the same as with a serial walk).
+ *
+ * The subject of the walk can also be a plain integer or numeric vector
+ * (see vector_viewSummaries() below). Only the "sum" and "mean" of complex
+ * values are supported.
+ */
+
+#define NSTAT	9
+
+static const char *stat_names[NSTAT] = {
+	"min", "max", "sum", "mean", "which.min", "which.max", "count.nonzero",
+	"which.min.end", "which.max.end"
+};
+
+enum {
+	STAT_MIN, STAT_MAX, STAT_SUM, STAT_MEAN,
+	STAT_WHICH_MIN, STAT_WHICH_MAX, STAT_COUNT_NONZERO,
+	STAT_WHICH_MIN_END, STAT_WHICH_MAX_END
+};
+
+typedef struct view_summary {
+	int has_na;		/* the walk stops at the 1st NA if !narm */
+	int n;			/* nb of non-NA positions */
+	int nnonzero;
+	int imin, imax;		/* type 'i' */
+	double rmin, rmax;	/* type 'r' */
+	long long int isum;	/* type 'i' */
+	double rsum;		/* type 'r' */
+	Rcomplex csum;		/* type 'c' */
+	int which_min, which_max;
+	int which_min_end, which_max_end;
+} ViewSummary;
+
+typedef struct prefix_sums PrefixSums;
+
+typedef struct views_walk {
+	char type;
+	int nrun;
+	/* NULL if the subject is a plain vector. Then 'ivalues' or 'rvalues'
+	   contains its 'subject_len' values and 'nrun' is 0. */
+	const int *lengths;
+	const int *ivalues;	/* type 'i' */
+	const double *rvalues;	/* type 'r' */
+	const Rcomplex *cvalues;	/* type 'c' */
+	int subject_len;
+	/* NULL or a prefix-sum index on the plain vector. */
+	const PrefixSums *psums;
 	IRanges_holder ranges_holder;
+	/* NULL or the order in which the views must be visited (see
+	   get_views_order()). The walk summarizes the views visited in
+	   positions first_view to first_view + nview - 1. */
+	const int *order;
+	int first_view, nview;
+	/* The end positions of the runs (NULL if the subject is a plain
+	   vector). The run containing the start of a view is found by binary
+	   search when the walk would otherwise have to go back, or to go
+	   forward by more than 1 run. */
+	const int *run_ends;
+	int narm;
+	int check_interrupt;	/* can only be 1 on the main thread */
+	/* The j-th summary of view i goes to cols[j][offset + i]. */
+	int nstat;
+	const int *stat_codes;
+	void **cols;
+	int offset;
+	int ovflow;		/* set to 1 on integer overflow */
+} ViewsWalk;
+
+static int get_stat_code(const char *stat)
+{
+	int j;
+
+	for (j = 0; j < NSTAT; j++)
+		if (strcmp(stat, stat_names[j]) == 0)
+			return j;
+	error("invalid summary \"%s\"", stat);
+	return -1;
+}
+
+static int *get_stat_codes(SEXP stats)
+{
+	int nstat, j, *stat_codes;
+
+	nstat = LENGTH(stats);
+	stat_codes = (int *) R_alloc(nstat, sizeof(int));
+	for (j = 0; j < nstat; j++)
+		stat_codes[j] = get_stat_code(CHAR(STRING_ELT(stats, j)));
+	return stat_codes;
+}
+
+static int get_narm(SEXP na_rm)
+{
+	if (!IS_LOGICAL(na_rm) || LENGTH(na_rm) != 1 ||
+	    LOGICAL(na_rm)[0] == NA_LOGICAL)
+		error("'na.rm' must be TRUE or FALSE");
+	return LOGICAL(na_rm)[0];
+}
+
+static void check_complex_stats(char type, const int *stat_codes,
+		int nstat)
+{
+	int j;
+
+	if (type != 'c')
+		return;
+	for (j = 0; j < nstat; j++)
+		if (stat_codes[j] != STAT_SUM && stat_codes[j] != STAT_MEAN)
+			error("Rle must contain either 'integer' or "
+			      "'numeric' values");
+	return;
+}
+
+/* Must be called on the main thread. Returns the type of the values of
+   the subject ('i', 'r', or 'c'). */
+static char prepare_views_walk(SEXP x, int narm, ViewsWalk *walk)
+{
+	SEXP subject, values, lengths;
+	int *run_ends;
 
 	subject = GET_SLOT(x, install("subject"));
 	values = GET_SLOT(subject, install("values"));
 	lengths = GET_SLOT(subject, install("lengths"));
-	ranges = GET_SLOT(x, install("ranges"));
-	ranges_holder = _hold_IRanges(ranges);
-	ans_len = _get_length_from_IRanges_holder(&ranges_holder);
-
-	ans = R_NilValue;
+	walk->ivalues = NULL;
+	walk->rvalues = NULL;
+	walk->cvalues = NULL;
 	switch (TYPEOF(values)) {
-    case LGLSXP:
-    case INTSXP:
-		type = 'i';
-		PROTECT(ans = NEW_INTEGER(ans_len));
+	    case LGLSXP:
+	    case INTSXP:
+		walk->type = 'i';
+		walk->ivalues = INTEGER(values);
 		break;
-    case REALSXP:
-		type = 'r';
-		PROTECT(ans = NEW_NUMERIC(ans_len));
+	    case REALSXP:
+		walk->type = 'r';
+		walk->rvalues = REAL(values);
 		break;
-    default:
-		error("Rle must contain either 'integer' or 'numeric' values");
-    }
+	    case CPLXSXP:
+		walk->type = 'c';
+		walk->cvalues = COMPLEX(values);
+		break;
+	    default:
+		error("Rle must contain either 'integer', 'numeric', or "
+		      "'complex' values");
+	}
+	walk->nrun = LENGTH(lengths);
+	walk->lengths = INTEGER(lengths);
+	run_ends = get_run_ends(lengths);
+	walk->run_ends = run_ends;
+	walk->subject_len = walk->nrun != 0 ? run_ends[walk->nrun - 1] : 0;
+	walk->ranges_holder = _hold_IRanges(GET_SLOT(x, install("ranges")));
+	walk->order = NULL;
+	walk->first_view = 0;
+	walk->nview = _get_length_from_IRanges_holder(&walk->ranges_holder);
+	walk->psums = NULL;
+	walk->narm = narm;
+	walk->check_interrupt = 0;
+	walk->ovflow = 0;
+	return walk->type;
+}
 
-	if (!IS_LOGICAL(na_rm) || LENGTH(na_rm) != 1 || LOGICAL(na_rm)[0] == NA_LOGICAL)
-		error("'na.rm' must be TRUE or FALSE");
+static SEXP alloc_stat_col(char type, int stat, int len)
+{
+	switch (stat) {
+	    case STAT_MIN: case STAT_MAX: case STAT_SUM:
+		if (type == 'c')
+			return NEW_COMPLEX(len);
+		return type == 'i' ? NEW_INTEGER(len) : NEW_NUMERIC(len);
+	    case STAT_MEAN:
+		return type == 'c' ? NEW_COMPLEX(len) : NEW_NUMERIC(len);
+	}
+	return NEW_INTEGER(len);
+}
 
-	lengths_elt = INTEGER(lengths);
-	max_index = LENGTH(lengths) - 1;
-	index = 0;
-	upper_run = *lengths_elt;
-	for (i = 0; i < ans_len; i++) {
-		if (i % 100000 == 99999)
-			R_CheckUserInterrupt();
-		start = _get_start_elt_from_IRanges_holder(&ranges_holder, i);
-		width = _get_width_elt_from_IRanges_holder(&ranges_holder, i);
-		if (type == 'i') {
-			INTEGER(ans)[i] = R_INT_MIN;
-		} else if (type == 'r') {
-			REAL(ans)[i] = R_NegInf;
+static void *get_col_ptr(SEXP col)
+{
+	switch (TYPEOF(col)) {
+	    case INTSXP:
+		return INTEGER(col);
+	    case CPLXSXP:
+		return COMPLEX(col);
+	}
+	return REAL(col);
+}
+
+static void init_view_summary(ViewSummary *summary)
+{
+	summary->has_na = 0;
+	summary->n = summary->nnonzero = 0;
+	summary->imin = INT_MAX;
+	summary->imax = R_INT_MIN;
+	summary->rmin = R_PosInf;
+	summary->rmax = R_NegInf;
+	summary->isum = 0;
+	summary->rsum = 0.0;
+	summary->csum.r = summary->csum.i = 0.0;
+	summary->which_min = summary->which_max = NA_INTEGER;
+	summary->which_min_end = summary->which_max_end = NA_INTEGER;
+	return;
+}
+
+/* Adds the 'npos' positions of run 'k' that start at position 'pos' to
+   'summary'. Returns 0 if the walk must stop. */
+static int add_run_to_view_summary(const ViewsWalk *walk, int k,
+		int pos, int npos, ViewSummary *summary)
+{
+	int iv;
+	double rv;
+	Rcomplex cv;
+
+	if (walk->type == 'i') {
+		iv = walk->ivalues[k];
+		if (iv == NA_INTEGER) {
+			summary->has_na = 1;
+			return walk->narm;
+		}
+		if (iv < summary->imin) {
+			summary->imin = iv;
+			summary->which_min = pos;
+			summary->which_min_end = pos + npos - 1;
+		}
+		if (iv > summary->imax) {
+			summary->imax = iv;
+			summary->which_max = pos;
+			summary->which_max_end = pos + npos - 1;
+		}
+		summary->isum += (long long int) iv * npos;
+		if (iv != 0)
+			summary->nnonzero += npos;
+	} else if (walk->type == 'r') {
+		rv = walk->rvalues[k];
+		if (ISNAN(rv)) {
+			summary->has_na = 1;
+			return walk->narm;
+		}
+		if (rv < summary->rmin) {
+			summary->rmin = rv;
+			summary->which_min = pos;
+			summary->which_min_end = pos + npos - 1;
+		}
+		if (rv > summary->rmax) {
+			summary->rmax = rv;
+			summary->which_max = pos;
+			summary->which_max_end = pos + npos - 1;
 		}
+		summary->rsum += rv * npos;
+		if (rv != 0.0)
+			summary->nnonzero += npos;
+	} else {
+		cv = walk->cvalues[k];
+		if (ISNAN(cv.r) || ISNAN(cv.i)) {
+			summary->has_na = 1;
+			return walk->narm;
+		}
+		summary->csum.r += cv.r * npos;
+		summary->csum.i += cv.i * npos;
+		if (cv.r != 0.0 || cv.i != 0.0)
+			summary->nnonzero += npos;
+	}
+	summary->n += npos;
+	return 1;
+}
+
+/* Returns 0 on integer overflow. */
+static int set_view_summary(const ViewsWalk *walk,
+		const ViewSummary *summary, int width, int stat, void *col,
+		int i)
+{
+	int is_na, *icol;
+	double *rcol;
+	Rcomplex *ccol;
+
+	is_na = summary->has_na && !walk->narm;
+	icol = (int *) col;
+	rcol = (double *) col;
+	ccol = (Rcomplex *) col;
+	switch (stat) {
+	    case STAT_MIN: case STAT_MAX:
+		if (walk->type == 'i') {
+			icol[i] = is_na ? NA_INTEGER :
+				stat == STAT_MIN ? summary->imin : summary->imax;
+		} else {
+			rcol[i] = is_na ? NA_REAL :
+				stat == STAT_MIN ? summary->rmin : summary->rmax;
+		}
+		break;
+	    case STAT_SUM:
+		if (walk->type == 'i') {
+			if (is_na) {
+				icol[i] = NA_INTEGER;
+				break;
+			}
+			if (summary->isum > INT_MAX ||
+			    summary->isum < R_INT_MIN)
+				return 0;
+			icol[i] = (int) summary->isum;
+		} else if (walk->type == 'r') {
+			rcol[i] = is_na ? NA_REAL : summary->rsum;
+		} else if (is_na) {
+			ccol[i].r = ccol[i].i = NA_REAL;
+		} else {
+			ccol[i] = summary->csum;
+		}
+		break;
+	    case STAT_MEAN:
+		if (walk->type == 'c') {
+			if (width <= 0 || (!is_na && summary->n == 0)) {
+				ccol[i].r = ccol[i].i = R_NaN;
+			} else if (is_na) {
+				ccol[i].r = ccol[i].i = NA_REAL;
+			} else {
+				ccol[i].r = summary->csum.r / summary->n;
+				ccol[i].i = summary->csum.i / summary->n;
+			}
+		} else if (width <= 0 || (!is_na && summary->n == 0)) {
+			rcol[i] = R_NaN;
+		} else if (is_na) {
+			rcol[i] = NA_REAL;
+		} else if (walk->type == 'i') {
+			rcol[i] = (double) summary->isum / summary->n;
+		} else {
+			rcol[i] = summary->rsum / summary->n;
+		}
+		break;
+	    case STAT_WHICH_MIN:
+		icol[i] = summary->which_min;
+		break;
+	    case STAT_WHICH_MAX:
+		icol[i] = summary->which_max;
+		break;
+	    case STAT_COUNT_NONZERO:
+		icol[i] = is_na ? NA_INTEGER : summary->nnonzero;
+		break;
+	    case STAT_WHICH_MIN_END:
+		icol[i] = summary->which_min_end;
+		break;
+	    case STAT_WHICH_MAX_END:
+		icol[i] = summary->which_max_end;
+		break;
+	}
+	return 1;
+}
+
+static void walk_dense_views(ViewsWalk *walk);
+
+static void walk_views(ViewsWalk *walk)
+{
+	int m, i, j, k, start, end, width,
+	    lower_run, upper_run, lower_bound, upper_bound;
+	const int *lengths_elt;
+	ViewSummary summary;
+
+	if (walk->lengths == NULL) {
+		walk_dense_views(walk);
+		return;
+	}
+	lengths_elt = walk->lengths;
+	k = 0;
+	upper_run = walk->nrun != 0 ? *lengths_elt : 0;
+	for (m = walk->first_view; m < walk->first_view + walk->nview; m++) {
+		if (walk->check_interrupt && m % 100000 == 99999)
+			R_CheckUserInterrupt();
+		i = walk->order != NULL ? walk->order[m] : m;
+		start = _get_start_elt_from_IRanges_holder(
+					&walk->ranges_holder, i);
+		end = _get_end_elt_from_IRanges_holder(
+					&walk->ranges_holder, i);
+		/* Same as trim(). */
+		if (start < 1)
+			start = 1;
+		if (end > walk->subject_len)
+			end = walk->subject_len;
+		width = end >= start ? end - start + 1 : 0;
+		init_view_summary(&summary);
 		if (width > 0) {
-			while (index > 0 && upper_run > start) {
-				upper_run -= *lengths_elt;
-				lengths_elt--;
-				index--;
+			if (m == walk->first_view ||
+			    upper_run - *lengths_elt >= start ||
+			    (k + 1 < walk->nrun &&
+			     walk->run_ends[k + 1] < start))
+			{
+				k = find_run(walk->run_ends, walk->nrun,
+					     start);
+				lengths_elt = walk->lengths + k;
+				upper_run = walk->run_ends[k];
 			}
 			while (upper_run < start) {
 				lengths_elt++;
-				index++;
+				k++;
 				upper_run += *lengths_elt;
 			}
 			lower_run = upper_run - *lengths_elt + 1;
-			upper_bound = start + width - 1;
-			if (type == 'i') {
-				while (lower_run <= upper_bound) {
-					if (INTEGER(values)[index] == NA_INTEGER) {
-						if (!LOGICAL(na_rm)[0]) {
-							INTEGER(ans)[i] = NA_INTEGER;
-							break;
-						}
-					} else if (INTEGER(values)[index] > INTEGER(ans)[i]) {
-						INTEGER(ans)[i] = INTEGER(values)[index];
-					}
-					if (index < max_index) {
-						lengths_elt++;
-						index++;
-						lower_run = upper_run + 1;
-						upper_run += *lengths_elt;
-					} else {
-						break;
-					}
-				}
-			} else if (type == 'r') {
-				while (lower_run <= upper_bound) {
-					if (ISNAN(REAL(values)[index])) {
-						if (!LOGICAL(na_rm)[0]) {
-							REAL(ans)[i] = NA_REAL;
-							break;
-						}
-					} else if (REAL(values)[index] > REAL(ans)[i]) {
-						REAL(ans)[i] = REAL(values)[index];
-					}
-					if (index < max_index) {
-						lengths_elt++;
-						index++;
-						lower_run = upper_run + 1;
-						upper_run += *lengths_elt;
-					} else {
-						break;
-					}
-				}
+			lower_bound = start;
+			upper_bound = end;
+			while (lower_run <= upper_bound) {
+				if (!add_run_to_view_summary(walk, k,
+					lower_bound,
+					1 + (upper_bound < upper_run ?
+					     upper_bound : upper_run) -
+					    lower_bound,
+					&summary))
+					break;
+				if (k == walk->nrun - 1)
+					break;
+				lengths_elt++;
+				k++;
+				lower_run = upper_run + 1;
+				lower_bound = lower_run;
+				upper_run += *lengths_elt;
+			}
+		}
+		for (j = 0; j < walk->nstat; j++) {
+			if (!set_view_summary(walk, &summary, width,
+					      walk->stat_codes[j],
+					      walk->cols[j], walk->offset + i)) {
+				walk->ovflow = 1;
+				return;
 			}
 		}
 	}
-	PROTECT(names = duplicate(_get_IRanges_names(ranges)));
-	SET_NAMES(ans, names);
-	UNPROTECT(2);
+	return;
+}
+
+/* When the views are summarized concurrently, the walks are split in
+   chunks of at least MIN_CHUNK_LEN views that are consecutive in the order
+   of the walk (4 chunks per thread when there are enough views, to balance
+   the load between the threads). */
+#define MIN_CHUNK_LEN	10000
+
+/* Must be called on the main thread. Returns the nb of chunks. */
+static int split_views_walks(const ViewsWalk *walks, int nwalk,
+		int nthreads, ViewsWalk **chunks)
+{
+	long long int total_nview;
+	int chunk_len, nchunk, k, m, n;
+	const ViewsWalk *walk;
+	ViewsWalk *chunk;
+
+	total_nview = 0;
+	for (k = 0; k < nwalk; k++)
+		total_nview += walks[k].nview;
+	chunk_len = (int) (total_nview / (4LL * nthreads));
+	if (chunk_len < MIN_CHUNK_LEN)
+		chunk_len = MIN_CHUNK_LEN;
+	nchunk = 0;
+	for (k = 0; k < nwalk; k++)
+		nchunk += walks[k].nview == 0 ? 1 :
+			  (walks[k].nview - 1) / chunk_len + 1;
+	*chunks = (ViewsWalk *) R_alloc(nchunk, sizeof(ViewsWalk));
+	chunk = *chunks;
+	for (k = 0, walk = walks; k < nwalk; k++, walk++) {
+		n = walk->nview == 0 ? 1 : (walk->nview - 1) / chunk_len + 1;
+		/* Each chunk finds the run containing the start of its 1st
+		   view by binary search. */
+		for (m = 0; m < n; m++, chunk++) {
+			*chunk = *walk;
+			chunk->first_view = walk->first_view + m * chunk_len;
+			if (m < n - 1)
+				chunk->nview = chunk_len;
+			else
+				chunk->nview = walk->nview - m * chunk_len;
+		}
+	}
+	return nchunk;
+}
+
+/* Runs the walks concurrently if 'nthreads' is > 1 and OpenMP is
+   available. Only the walks run on the main thread can be interrupted by
+   the user. Returns 1 if an integer overflow occurred, 0 otherwise. */
+static int run_views_walks(ViewsWalk *walks, int nwalk, int nthreads)
+{
+	int k;
+
+	for (k = 0; k < nwalk; k++)
+		if (walks[k].lengths != NULL)
+			walks[k].order = get_views_order(
+						&walks[k].ranges_holder);
+	if (nthreads > 1)
+		nwalk = split_views_walks(walks, nwalk, nthreads, &walks);
+#ifdef _OPENMP
+	if (nthreads > 1 && nwalk > 1) {
+		#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1)
+		for (k = 0; k < nwalk; k++)
+			walk_views(walks + k);
+		for (k = 0; k < nwalk; k++)
+			if (walks[k].ovflow)
+				return 1;
+		return 0;
+	}
+#endif
+	for (k = 0; k < nwalk; k++) {
+		walks[k].check_interrupt = 1;
+		walk_views(walks + k);
+		if (walks[k].ovflow)
+			return 1;
+	}
+	return 0;
+}
+
+/* Allocates the summaries of 'ans_len' views. Returns a named list with 1
+   element per summary and points the 'cols' member of the walks to its
+   elements. */
+static SEXP alloc_views_summaries(char type, SEXP stats,
+		const int *stat_codes, int ans_len, ViewsWalk *walks, int nwalk)
+{
+	SEXP ans, ans_col;
+	int nstat, j, k;
+	void **cols;
+
+	nstat = LENGTH(stats);
+	cols = (void **) R_alloc(nstat, sizeof(void *));
+	PROTECT(ans = NEW_LIST(nstat));
+	for (j = 0; j < nstat; j++) {
+		ans_col = alloc_stat_col(type, stat_codes[j], ans_len);
+		SET_VECTOR_ELT(ans, j, ans_col);
+		cols[j] = get_col_ptr(ans_col);
+	}
+	SET_NAMES(ans, duplicate(stats));
+	for (k = 0; k < nwalk; k++) {
+		walks[k].nstat = nstat;
+		walks[k].stat_codes = stat_codes;
+		walks[k].cols = cols;
+	}
+	UNPROTECT(1);
 	return ans;
 }
 
 /*
  * --- .Call ENTRY POINT ---
+ * 'stats' must be a character vector of unique summary names. 'nthreads'
+ * must be a single positive integer, the number of threads to use to
+ * summarize chunks of views (only used if OpenMP is available). Returns a
+ * named list with 1 element per summary.
  */
-SEXP RleViews_viewSums(SEXP x, SEXP na_rm)
+SEXP RleViews_viewSummaries(SEXP x, SEXP na_rm, SEXP stats, SEXP nthreads)
 {
-	char type = '?';
-	int i, start, width, ans_len, index,
-	    lower_run, upper_run, lower_bound, upper_bound;
-	int max_index, *lengths_elt;
-	SEXP ans, subject, values, lengths, ranges, names;
-	IRanges_holder ranges_holder;
+	ViewsWalk walk;
+	int *stat_codes, nthreads0;
+	char type;
+	SEXP ans;
 
+	stat_codes = get_stat_codes(stats);
+	nthreads0 = _get_nthreads(nthreads);
+	type = prepare_views_walk(x, get_narm(na_rm), &walk);
+	check_complex_stats(type, stat_codes, LENGTH(stats));
+	walk.offset = 0;
+	PROTECT(ans = alloc_views_summaries(type, stats, stat_codes,
+			walk.nview, &walk, 1));
+	if (run_views_walks(&walk, 1, nthreads0))
+		error("Integer overflow");
+	UNPROTECT(1);
+	return ans;
+}
+
+/*
+ * --- .Call ENTRY POINT ---
+ * Args:
+ *   x:        The list of RleViews objects of an RleViewsList object.
+ *   na_rm:    TRUE or FALSE.
+ *   stats:    A character vector of unique summary names.
+ *   nthreads: A single positive integer. The number of threads to use to
+ *             summarize the elements of 'x' and chunks of their views
+ *             (only used if OpenMP is available).
+ * Returns NULL if the subjects don't all contain values of the same type
+ * (integer/logical or numeric). Otherwise returns a list of length 3:
+ *   1. A named list with 1 element per summary, each of them of the total
+ *      nb of views.
+ *   2. The cumulated nb of views of the elements of 'x' (to partition the
+ *      above).
+ *   3. The names of the views (NULL if none of the elements of 'x' has
+ *      names).
+ */
+SEXP RleViewsList_viewSummaries(SEXP x, SEXP na_rm, SEXP stats,
+		SEXP nthreads)
+{
+	ViewsWalk *walks;
+	const IRanges_holder *ranges_holder;
+	int nelt, narm, nthreads0, i, j, n, ans_len, has_names, *stat_codes;
+	char type, elt_type;
+	SEXP ans, ans_breakpoints, ans_names;
+
+	stat_codes = get_stat_codes(stats);
+	narm = get_narm(na_rm);
+	nthreads0 = _get_nthreads(nthreads);
+	nelt = LENGTH(x);
+	walks = (ViewsWalk *) R_alloc(nelt, sizeof(ViewsWalk));
+	PROTECT(ans_breakpoints = NEW_INTEGER(nelt));
+	type = 'i';
+	ans_len = has_names = 0;
+	for (i = 0; i < nelt; i++) {
+		elt_type = prepare_views_walk(VECTOR_ELT(x, i), narm,
+					      walks + i);
+		if (i == 0)
+			type = elt_type;
+		if (elt_type != type) {
+			UNPROTECT(1);
+			return R_NilValue;
+		}
+		check_complex_stats(elt_type, stat_codes, LENGTH(stats));
+		walks[i].offset = ans_len;
+		ans_len += _get_length_from_IRanges_holder(
+					&walks[i].ranges_holder);
+		INTEGER(ans_breakpoints)[i] = ans_len;
+		if (walks[i].ranges_holder.names != R_NilValue)
+			has_names = 1;
+	}
+	PROTECT(ans = NEW_LIST(3));
+	SET_VECTOR_ELT(ans, 0, alloc_views_summaries(type, stats, stat_codes,
+						      ans_len, walks, nelt));
+	SET_VECTOR_ELT(ans, 1, ans_breakpoints);
+	if (has_names) {
+		PROTECT(ans_names = NEW_CHARACTER(ans_len));
+		for (i = 0; i < nelt; i++) {
+			ranges_holder = &walks[i].ranges_holder;
+			if (ranges_holder->names == R_NilValue)
+				continue;
+			n = _get_length_from_IRanges_holder(ranges_holder);
+			for (j = 0; j < n; j++)
+				SET_STRING_ELT(ans_names, walks[i].offset + j,
+					_get_names_elt_from_IRanges_holder(
+						ranges_holder, j));
+		}
+		SET_VECTOR_ELT(ans, 2, ans_names);
+		UNPROTECT(1);
+	}
+
+	if (run_views_walks(walks, nelt, nthreads0))
+		error("Integer overflow");
+	UNPROTECT(2);
+	return ans;
+}
+
+
+/****************************************************************************
+ * viewMins(), viewMaxs(), viewSums(), viewMeans(), viewWhichMins(), and
+ * viewWhichMaxs() on an RleViews object.
+ *
+ * The summary is computed with the walk above unless it's answered with an
+ * index on the runs of the subject (see 'use_index' at the top of this
+ * file).
+ */
+
+static SEXP summarize_views(SEXP x, SEXP na_rm, SEXP use_index, int stat)
+{
+	ViewsWalk walk;
+	SEXP subject, values, lengths, ans, names;
+	char type;
+	int narm, is_max, which;
+	void *col;
+
+	narm = get_narm(na_rm);
+	check_use_index(use_index);
+	type = prepare_views_walk(x, narm, &walk);
+	check_complex_stats(type, &stat, 1);
 	subject = GET_SLOT(x, install("subject"));
 	values = GET_SLOT(subject, install("values"));
 	lengths = GET_SLOT(subject, install("lengths"));
-	ranges = GET_SLOT(x, install("ranges"));
-	ranges_holder = _hold_IRanges(ranges);
-	ans_len = _get_length_from_IRanges_holder(&ranges_holder);
+	PROTECT(ans = alloc_stat_col(type, stat, walk.nview));
+	is_max = stat == STAT_MAX || stat == STAT_WHICH_MAX;
+	which = stat == STAT_WHICH_MIN || stat == STAT_WHICH_MAX;
+	if (stat != STAT_SUM && stat != STAT_MEAN &&
+	    use_rmq(use_index, lengths, &walk.ranges_holder))
+	{
+		rmq_view_extremes(type, values, lengths, &walk.ranges_holder,
+				  narm, is_max, which, ans);
+	} else if (type == 'i' && stat == STAT_SUM &&
+		   use_runs_index(use_index, lengths, &walk.ranges_holder))
+	{
+		runs_index_view_sums(values, lengths, &walk.ranges_holder,
+				     narm, ans);
+	} else if (type == 'i' && stat == STAT_MEAN &&
+		   use_runs_index(use_index, lengths, &walk.ranges_holder))
+	{
+		runs_index_view_means(values, lengths, &walk.ranges_holder,
+				      narm, ans);
+	} else {
+		col = get_col_ptr(ans);
+		walk.nstat = 1;
+		walk.stat_codes = &stat;
+		walk.cols = &col;
+		walk.offset = 0;
+		if (run_views_walks(&walk, 1, 1))
+			error("Integer overflow");
+	}
+	PROTECT(names = duplicate(_get_IRanges_names(
+					GET_SLOT(x, install("ranges")))));
+	SET_NAMES(ans, names);
+	UNPROTECT(2);
+	return ans;
+}
 
-	ans = R_NilValue;
-	switch (TYPEOF(values)) {
-    case LGLSXP:
-    case INTSXP:
-		type = 'i';
-		PROTECT(ans = NEW_INTEGER(ans_len));
-		break;
-    case REALSXP:
-		type = 'r';
-		PROTECT(ans = NEW_NUMERIC(ans_len));
-		break;
-    case CPLXSXP:
-		type = 'c';
-		PROTECT(ans = NEW_COMPLEX(ans_len));
-		break;
-    default:
-		error("Rle must contain either 'integer', 'numeric', or 'complex' values");
-    }
+/*
+ * --- .Call ENTRY POINT ---
+ */
+SEXP RleViews_viewMins(SEXP x, SEXP na_rm, SEXP use_index)
+{
+	return summarize_views(x, na_rm, use_index, STAT_MIN);
+}
 
-	if (!IS_LOGICAL(na_rm) || LENGTH(na_rm) != 1 || LOGICAL(na_rm)[0] == NA_LOGICAL)
-		error("'na.rm' must be TRUE or FALSE");
+/*
+ * --- .Call ENTRY POINT ---
+ */
+SEXP RleViews_viewMaxs(SEXP x, SEXP na_rm, SEXP use_index)
+{
+	return summarize_views(x, na_rm, use_index, STAT_MAX);
+}
 
-	lengths_elt = INTEGER(lengths);
-	max_index = LENGTH(lengths) - 1;
-	index = 0;
-	upper_run = *lengths_elt;
-	for (i = 0; i < ans_len; i++) {
-		if (i % 100000 == 99999)
-			R_CheckUserInterrupt();
-		start = _get_start_elt_from_IRanges_holder(&ranges_holder, i);
-		width = _get_width_elt_from_IRanges_holder(&ranges_holder, i);
-		if (type == 'i') {
-			INTEGER(ans)[i] = 0;
-		} else if (type == 'r') {
-			REAL(ans)[i] = 0;
-		} else if (type == 'c') {
-			COMPLEX(ans)[i].r = 0;
-			COMPLEX(ans)[i].i = 0;
+/*
+ * --- .Call ENTRY POINT ---
+ */
+SEXP RleViews_viewSums(SEXP x, SEXP na_rm, SEXP use_index)
+{
+	return summarize_views(x, na_rm, use_index, STAT_SUM);
+}
+
+/*
+ * --- .Call ENTRY POINT ---
+ */
+SEXP RleViews_viewMeans(SEXP x, SEXP na_rm, SEXP use_index)
+{
+	return summarize_views(x, na_rm, use_index, STAT_MEAN);
+}
+
+/*
+ * --- .Call ENTRY POINT ---
+ */
+SEXP RleViews_viewWhichMins(SEXP x, SEXP na_rm, SEXP use_index)
+{
+	return summarize_views(x, na_rm, use_index, STAT_WHICH_MIN);
+}
+
+/*
+ * --- .Call ENTRY POINT ---
+ */
+SEXP RleViews_viewWhichMaxs(SEXP x, SEXP na_rm, SEXP use_index)
+{
+	return summarize_views(x, na_rm, use_index, STAT_WHICH_MAX);
+}
+
+
+/****************************************************************************
+ * View summaries on a plain integer or numeric vector.
+ *
+ * The values of a view are contiguous in memory so each summary is a
+ * reduction over a slice of the vector. The reductions are written as
+ * branch-free loops that the compiler can vectorize (they are explicitly
+ * marked as SIMD loops when OpenMP >= 4.0 is available): the NAs are
+ * counted instead of tested, and removed from the sums and counts
+ * afterwards. The positions of the min and max (only needed for the
+ * "which.min" and "which.max" summaries) are found in a 2nd pass.
+ *
+ * When only the sums and/or means of an integer (or logical) vector are
+ * requested, the views can also be answered with a prefix-sum index on the
+ * vector (2 lookups per view), which is cheaper when the views are long or
+ * overlap a lot. Like for an Rle, there is no such index on a numeric
+ * vector because the difference of 2 cumulative sums of doubles would lose
+ * the precision of a view to the values that precede it.
+ */
+
+#if defined(_OPENMP) && _OPENMP >= 201307
+#define HAS_OMP_SIMD
+#endif
+
+struct prefix_sums {
+	/* The i-th elements of the arrays below are the totals for the 1st
+	   i values of the vector. They have subject_len + 1 elements. */
+	long long int *isums;	/* sum of the non-NA values */
+	int *nas;		/* nb of NAs */
+};
+
+/* Must be called on the main thread. Type 'i' only. */
+static PrefixSums *build_prefix_sums(const ViewsWalk *walk)
+{
+	PrefixSums *psums;
+	int n, i, iv;
+
+	n = walk->subject_len;
+	psums = (PrefixSums *) R_alloc(1, sizeof(PrefixSums));
+	psums->isums = (long long int *)
+		R_alloc(n + 1, sizeof(long long int));
+	psums->nas = (int *) R_alloc(n + 1, sizeof(int));
+	psums->isums[0] = 0;
+	psums->nas[0] = 0;
+	for (i = 0; i < n; i++) {
+		iv = walk->ivalues[i];
+		psums->nas[i + 1] = psums->nas[i] + (iv == NA_INTEGER);
+		psums->isums[i + 1] = psums->isums[i] +
+			(iv == NA_INTEGER ? 0 : iv);
+	}
+	return psums;
+}
+
+/* Only sets the members of 'summary' needed for the "sum" and "mean"
+   summaries. */
+static void add_prefix_sums_to_view_summary(const ViewsWalk *walk,
+		int start, int width, ViewSummary *summary)
+{
+	const PrefixSums *psums;
+	int i1, i2, nna;
+
+	psums = walk->psums;
+	i1 = start - 1;
+	i2 = i1 + width;
+	nna = psums->nas[i2] - psums->nas[i1];
+	summary->has_na = nna != 0;
+	summary->n = width - nna;
+	summary->isum = psums->isums[i2] - psums->isums[i1];
+	return;
+}
+
+/* 'v' points to the 'width' (> 0) values of the view that starts at
+   position 'start' of the vector. Like the walk on the runs of an Rle, the
+   search for the positions of the min and max stops at the 1st NA when
+   'narm' is FALSE. */
+static void summarize_dense_ints(const int *v, int start, int width,
+		int narm, int need_which, ViewSummary *summary)
+{
+	long long int isum;
+	int na, j, nna, nnonzero, imin, imax;
+
+	na = NA_INTEGER;  /* so the compiler knows it's not in 'v' */
+	isum = 0;
+	nna = nnonzero = 0;
+	imin = INT_MAX;
+	imax = R_INT_MIN;
+#ifdef HAS_OMP_SIMD
+	#pragma omp simd reduction(+:isum,nna,nnonzero) \
+			 reduction(min:imin) reduction(max:imax)
+#endif
+	for (j = 0; j < width; j++) {
+		int vj = v[j], vmin = vj == na ? INT_MAX : vj;
+		isum += vj;
+		nna += vj == na;
+		nnonzero += vj != 0;
+		imin = vmin < imin ? vmin : imin;
+		/* NA_INTEGER is INT_MIN so it's never > imax. */
+		imax = vj > imax ? vj : imax;
+	}
+	/* Each NA was added to 'isum' and counted as a non-zero value. */
+	summary->isum = isum - (long long int) na * nna;
+	summary->nnonzero = nnonzero - nna;
+	summary->n = width - nna;
+	summary->has_na = nna != 0;
+	summary->imin = imin;
+	summary->imax = imax;
+	if (!need_which)
+		return;
+	if (nna != 0 && !narm) {
+		for (width = 0; v[width] != na; width++) {}
+		imin = INT_MAX;
+		imax = R_INT_MIN;
+#ifdef HAS_OMP_SIMD
+		#pragma omp simd reduction(min:imin) reduction(max:imax)
+#endif
+		for (j = 0; j < width; j++) {
+			imin = v[j] < imin ? v[j] : imin;
+			imax = v[j] > imax ? v[j] : imax;
+		}
+	}
+	if (imin != INT_MAX) {
+		for (j = 0; v[j] != imin; j++) {}
+		summary->which_min = start + j;
+		while (j + 1 < width && v[j + 1] == imin)
+			j++;
+		summary->which_min_end = start + j;
+	}
+	if (imax != R_INT_MIN) {
+		for (j = 0; v[j] != imax; j++) {}
+		summary->which_max = start + j;
+		while (j + 1 < width && v[j + 1] == imax)
+			j++;
+		summary->which_max_end = start + j;
+	}
+	return;
+}
+
+static void summarize_dense_doubles(const double *v, int start, int width,
+		int narm, int need_which, ViewSummary *summary)
+{
+	/* The counts are accumulated as doubles (they are exact) so the
+	   loop only involves one type and can be vectorized. */
+	double rsum, rmin, rmax, n, nnonzero;
+	int j;
+
+	rsum = n = nnonzero = 0.0;
+	rmin = R_PosInf;
+	rmax = R_NegInf;
+#ifdef HAS_OMP_SIMD
+	#pragma omp simd reduction(+:rsum,n,nnonzero) \
+			 reduction(min:rmin) reduction(max:rmax)
+#endif
+	for (j = 0; j < width; j++) {
+		double vj = v[j], not_na = ISNAN(vj) ? 0.0 : 1.0;
+		rsum += ISNAN(vj) ? 0.0 : vj;
+		n += not_na;
+		nnonzero += vj != 0.0 ? not_na : 0.0;
+		/* The comparisons are false for NaN. */
+		rmin = vj < rmin ? vj : rmin;
+		rmax = vj > rmax ? vj : rmax;
+	}
+	summary->rsum = rsum;
+	summary->nnonzero = (int) nnonzero;
+	summary->n = (int) n;
+	summary->has_na = summary->n != width;
+	summary->rmin = rmin;
+	summary->rmax = rmax;
+	if (!need_which)
+		return;
+	if (summary->has_na && !narm) {
+		for (width = 0; !ISNAN(v[width]); width++) {}
+		rmin = R_PosInf;
+		rmax = R_NegInf;
+#ifdef HAS_OMP_SIMD
+		#pragma omp simd reduction(min:rmin) reduction(max:rmax)
+#endif
+		for (j = 0; j < width; j++) {
+			rmin = v[j] < rmin ? v[j] : rmin;
+			rmax = v[j] > rmax ? v[j] : rmax;
 		}
+	}
+	if (rmin != R_PosInf) {
+		for (j = 0; v[j] != rmin; j++) {}
+		summary->which_min = start + j;
+		while (j + 1 < width && v[j + 1] == rmin)
+			j++;
+		summary->which_min_end = start + j;
+	}
+	if (rmax != R_NegInf) {
+		for (j = 0; v[j] != rmax; j++) {}
+		summary->which_max = start + j;
+		while (j + 1 < width && v[j + 1] == rmax)
+			j++;
+		summary->which_max_end = start + j;
+	}
+	return;
+}
+
+static void walk_dense_views(ViewsWalk *walk)
+{
+	int i, j, start, end, width, need_which;
+	ViewSummary summary;
+
+	need_which = 0;
+	for (j = 0; j < walk->nstat; j++)
+		if (walk->stat_codes[j] == STAT_WHICH_MIN ||
+		    walk->stat_codes[j] == STAT_WHICH_MAX ||
+		    walk->stat_codes[j] == STAT_WHICH_MIN_END ||
+		    walk->stat_codes[j] == STAT_WHICH_MAX_END)
+			need_which = 1;
+	for (i = walk->first_view; i < walk->first_view + walk->nview; i++) {
+		if (walk->check_interrupt && i % 100000 == 99999)
+			R_CheckUserInterrupt();
+		start = _get_start_elt_from_IRanges_holder(
+					&walk->ranges_holder, i);
+		end = _get_end_elt_from_IRanges_holder(
+					&walk->ranges_holder, i);
+		/* Same as trim(). */
+		if (start < 1)
+			start = 1;
+		if (end > walk->subject_len)
+			end = walk->subject_len;
+		width = end >= start ? end - start + 1 : 0;
+		init_view_summary(&summary);
 		if (width > 0) {
-			while (index > 0 && upper_run > start) {
-				upper_run -= *lengths_elt;
-				lengths_elt--;
-				index--;
-			}
-			while (upper_run < start) {
-				lengths_elt++;
-				index++;
-				upper_run += *lengths_elt;
-			}
-			lower_run = upper_run - *lengths_elt + 1;
-			lower_bound = start;
-			upper_bound = start + width - 1;
-			if (type == 'i') {
-				while (lower_run <= upper_bound) {
-					if (INTEGER(values)[index] == NA_INTEGER) {
-						if (!LOGICAL(na_rm)[0]) {
-							INTEGER(ans)[i] = NA_INTEGER;
-							break;
-						}
-					} else {
-						INTEGER(ans)[i] += INTEGER(values)[index] *
-						    (1 + (upper_bound < upper_run ? upper_bound : upper_run) -
-						         (lower_bound > lower_run ? lower_bound : lower_run));
-					}
-					if (index < max_index) {
-						lengths_elt++;
-						index++;
-						lower_run = upper_run + 1;
-						lower_bound = lower_run;
-						upper_run += *lengths_elt;
-					} else {
-						break;
-					}
-				}
-				if (INTEGER(ans)[i] != NA_INTEGER &&
-					(INTEGER(ans)[i] > INT_MAX || INTEGER(ans)[i] < R_INT_MIN))
-					error("Integer overflow");
-			} else if (type == 'r') {
-				while (lower_run <= upper_bound) {
-					if (ISNAN(REAL(values)[index])) {
-						if (!LOGICAL(na_rm)[0]) {
-							REAL(ans)[i] = NA_REAL;
-							break;
-						}
-					} else {
-						REAL(ans)[i] += REAL(values)[index] *
-						    (1 + (upper_bound < upper_run ? upper_bound : upper_run) -
-						         (lower_bound > lower_run ? lower_bound : lower_run));
-					}
-					if (index < max_index) {
-						lengths_elt++;
-						index++;
-						lower_run = upper_run + 1;
-						lower_bound = lower_run;
-						upper_run += *lengths_elt;
-					} else {
-						break;
-					}
-				}
-			} else if (type == 'c') {
-				while (lower_run <= upper_bound) {
-					if (ISNAN(COMPLEX(values)[index].r) || ISNAN(COMPLEX(values)[index].i)) {
-						if (!LOGICAL(na_rm)[0]) {
-							COMPLEX(ans)[i].r = NA_REAL;
-							COMPLEX(ans)[i].i = NA_REAL;
-							break;
-						}
-					} else {
-						COMPLEX(ans)[i].r += COMPLEX(values)[index].r *
-						    (1 + (upper_bound < upper_run ? upper_bound : upper_run) -
-						         (lower_bound > lower_run ? lower_bound : lower_run));
-						COMPLEX(ans)[i].i += COMPLEX(values)[index].i *
-						    (1 + (upper_bound < upper_run ? upper_bound : upper_run) -
-						         (lower_bound > lower_run ? lower_bound : lower_run));
-					}
-					if (index < max_index) {
-						lengths_elt++;
-						index++;
-						lower_run = upper_run + 1;
-						lower_bound = lower_run;
-						upper_run += *lengths_elt;
-					} else {
-						break;
-					}
-				}
+			if (walk->psums != NULL)
+				add_prefix_sums_to_view_summary(walk,
+					start, width, &summary);
+			else if (walk->type == 'i')
+				summarize_dense_ints(
+					walk->ivalues + start - 1,
+					start, width, walk->narm,
+					need_which, &summary);
+			else
+				summarize_dense_doubles(
+					walk->rvalues + start - 1,
+					start, width, walk->narm,
+					need_which, &summary);
+		}
+		for (j = 0; j < walk->nstat; j++) {
+			if (!set_view_summary(walk, &summary, width,
+					      walk->stat_codes[j],
+					      walk->cols[j], walk->offset + i)) {
+				walk->ovflow = 1;
+				return;
 			}
 		}
 	}
-	PROTECT(names = duplicate(_get_IRanges_names(ranges)));
-	SET_NAMES(ans, names);
-	UNPROTECT(2);
-	return ans;
+	return;
+}
+
+/* The index is only used for the "sum" and "mean" summaries of an
+   integer vector. Building it costs a pass over the vector and each view
+   costs 2 lookups, instead of a pass over the values of the view. */
+static int use_prefix_sums(SEXP use_index, const ViewsWalk *walk)
+{
+	int j, i, start, end;
+	double walk_cost;
+
+	if (walk->type != 'i')
+		return 0;
+	for (j = 0; j < walk->nstat; j++)
+		if (walk->stat_codes[j] != STAT_SUM &&
+		    walk->stat_codes[j] != STAT_MEAN)
+			return 0;
+	if (LOGICAL(use_index)[0] != NA_LOGICAL)
+		return LOGICAL(use_index)[0];
+	walk_cost = 0.0;
+	for (i = 0; i < walk->nview; i++) {
+		start = _get_start_elt_from_IRanges_holder(
+					&walk->ranges_holder, i);
+		end = _get_end_elt_from_IRanges_holder(
+					&walk->ranges_holder, i);
+		if (start < 1)
+			start = 1;
+		if (end > walk->subject_len)
+			end = walk->subject_len;
+		if (end >= start)
+			walk_cost += end - start + 1;
+	}
+	return walk_cost >= INDEX_MIN_GAIN *
+			    ((double) walk->subject_len + walk->nview);
 }
 
 /*
  * --- .Call ENTRY POINT ---
+ * Same as RleViews_viewSummaries() but on the views defined by IRanges
+ * object 'ranges' on plain integer (or logical) or numeric vector 'x'.
+ * 'use_index' is TRUE, FALSE, or NA (see the top of this file). It's
+ * ignored if 'x' is numeric or if other summaries than "sum" and "mean"
+ * are requested.
  */
-SEXP RleViews_viewMeans(SEXP x, SEXP na_rm)
+SEXP vector_viewSummaries(SEXP x, SEXP ranges, SEXP na_rm, SEXP stats,
+		SEXP use_index, SEXP nthreads)
 {
-	char type = '?';
-	int i, n, start, width, ans_len, index,
-	    lower_run, upper_run, lower_bound, upper_bound;
-	int max_index, *lengths_elt;
-	SEXP ans, subject, values, lengths, ranges, names;
-	IRanges_holder ranges_holder;
+	ViewsWalk walk;
+	int *stat_codes, narm, nthreads0;
+	SEXP ans;
 
-	subject = GET_SLOT(x, install("subject"));
-	values = GET_SLOT(subject, install("values"));
-	lengths = GET_SLOT(subject, install("lengths"));
-	ranges = GET_SLOT(x, install("ranges"));
-	ranges_holder = _hold_IRanges(ranges);
-	ans_len = _get_length_from_IRanges_holder(&ranges_holder);
-
-	ans = R_NilValue;
-	switch (TYPEOF(values)) {
-    case LGLSXP:
-    case INTSXP:
-		type = 'i';
-		PROTECT(ans = NEW_NUMERIC(ans_len));
-		break;
-    case REALSXP:
-		type = 'r';
-		PROTECT(ans = NEW_NUMERIC(ans_len));
+	stat_codes = get_stat_codes(stats);
+	narm = get_narm(na_rm);
+	check_use_index(use_index);
+	nthreads0 = _get_nthreads(nthreads);
+	switch (TYPEOF(x)) {
+	    case LGLSXP:
+	    case INTSXP:
+		walk.type = 'i';
+		walk.ivalues = INTEGER(x);
+		walk.rvalues = NULL;
+		walk.cvalues = NULL;
 		break;
-    case CPLXSXP:
-		type = 'c';
-		PROTECT(ans = NEW_COMPLEX(ans_len));
+	    case REALSXP:
+		walk.type = 'r';
+		walk.ivalues = NULL;
+		walk.rvalues = REAL(x);
+		walk.cvalues = NULL;
 		break;
-    default:
-		error("Rle must contain either 'integer', 'numeric', or 'complex' values");
-    }
+	    default:
+		error("'x' must be an integer or numeric vector");
+	}
+	walk.nrun = 0;
+	walk.lengths = NULL;
+	walk.subject_len = LENGTH(x);
+	walk.psums = NULL;
+	walk.ranges_holder = _hold_IRanges(ranges);
+	walk.order = NULL;
+	walk.first_view = 0;
+	walk.nview = _get_length_from_IRanges_holder(&walk.ranges_holder);
+	walk.run_ends = NULL;
+	walk.narm = narm;
+	walk.check_interrupt = 0;
+	walk.ovflow = 0;
+	walk.offset = 0;
+	PROTECT(ans = alloc_views_summaries(walk.type, stats, stat_codes,
+			walk.nview, &walk, 1));
+	if (use_prefix_sums(use_index, &walk))
+		walk.psums = build_prefix_sums(&walk);
+	if (run_views_walks(&walk, 1, nthreads0))
+		error("Integer overflow");
+	UNPROTECT(1);
+	return ans;
+}
 
-	if (!IS_LOGICAL(na_rm) || LENGTH(na_rm) != 1 || LOGICAL(na_rm)[0] == NA_LOGICAL)
-		error("'na.rm' must be TRUE or FALSE");
 
-	lengths_elt = INTEGER(lengths);
-	max_index = LENGTH(lengths) - 1;
-	index = 0;
-	upper_run = *lengths_elt;
-	for (i = 0; i < ans_len; i++) {
-		if (i % 100000 == 99999)
-			R_CheckUserInterrupt();
-		start = _get_start_elt_from_IRanges_holder(&ranges_holder, i);
-		width = _get_width_elt_from_IRanges_holder(&ranges_holder, i);
-		if (width <= 0) {
-			if (type == 'i') {
-				REAL(ans)[i] = R_NaN;
-			} else if (type == 'r') {
-				REAL(ans)[i] = R_NaN;
-			} else if (type == 'c') {
-				COMPLEX(ans)[i].r = R_NaN;
-				COMPLEX(ans)[i].i = R_NaN;
+/****************************************************************************
+ * Order statistics, variances, and threshold counts of the views.
+ *
+ * The views are never decoded: the runs of a view are collected as
+ * (value, nb of positions) pairs, which are sorted by value for the order
+ * statistics (medians and quantiles). The results are the same as the ones
+ * returned by median(), quantile() (type 7), var(), and sum(v > threshold)
+ * on the values of each view. Like trim(), the views are clipped to the
+ * bounds of the subject.
+ */
+
+typedef struct weighted_value {
+	double value;
+	int weight;	/* nb of positions, cumulated after sorting */
+} WeightedValue;
+
+/* Must be called on the main thread. Returns the type of the values of
+   the subject ('i' or 'r'). */
+static char prepare_views_runs(SEXP x, int narm, ViewsWalk *walk)
+{
+	char type;
+
+	type = prepare_views_walk(x, narm, walk);
+	if (type == 'c')
+		error("Rle must contain either 'integer' or 'numeric' values");
+	walk->check_interrupt = 1;
+	return type;
+}
+
+/* Collects the non-NA runs of view 'i' in 'buf' and returns their nb. The
+   total nb of positions is written to '*n'. Returns -1 if the view contains
+   NAs and they are not removed. */
+static int collect_view_runs(const ViewsWalk *walk, int i,
+		WeightedValue *buf, int *n)
+{
+	int start, end, k, run_start, from, to, nbuf, iv;
+	double rv;
+
+	start = _get_start_elt_from_IRanges_holder(&walk->ranges_holder, i);
+	end = _get_end_elt_from_IRanges_holder(&walk->ranges_holder, i);
+	if (start < 1)
+		start = 1;
+	if (end > walk->subject_len)
+		end = walk->subject_len;
+	*n = nbuf = 0;
+	if (end < start)
+		return 0;
+	for (k = find_run(walk->run_ends, walk->nrun, start);
+	     k < walk->nrun; k++)
+	{
+		run_start = k == 0 ? 1 : walk->run_ends[k - 1] + 1;
+		if (run_start > end)
+			break;
+		if (walk->type == 'i') {
+			iv = walk->ivalues[k];
+			if (iv == NA_INTEGER) {
+				if (!walk->narm)
+					return -1;
+				continue;
 			}
+			rv = (double) iv;
 		} else {
-			n = width;
-			if (type == 'i') {
-				REAL(ans)[i] = 0;
-			} else if (type == 'r') {
-				REAL(ans)[i] = 0;
-			} else if (type == 'c') {
-				COMPLEX(ans)[i].r = 0;
-				COMPLEX(ans)[i].i = 0;
-			}
-			while (index > 0 && upper_run > start) {
-				upper_run -= *lengths_elt;
-				lengths_elt--;
-				index--;
-			}
-			while (upper_run < start) {
-				lengths_elt++;
-				index++;
-				upper_run += *lengths_elt;
-			}
-			lower_run = upper_run - *lengths_elt + 1;
-			lower_bound = start;
-			upper_bound = start + width - 1;
-			if (type == 'i') {
-				while (lower_run <= upper_bound) {
-					if (INTEGER(values)[index] == NA_INTEGER) {
-						if (!LOGICAL(na_rm)[0]) {
-							REAL(ans)[i] = NA_REAL;
-							break;
-						}
-						n -=
-						    (1 + (upper_bound < upper_run ? upper_bound : upper_run) -
-						         (lower_bound > lower_run ? lower_bound : lower_run));
-						
-					} else {
-						REAL(ans)[i] += INTEGER(values)[index] *
-						    (1 + (upper_bound < upper_run ? upper_bound : upper_run) -
-						         (lower_bound > lower_run ? lower_bound : lower_run));
-					}
-					if (index < max_index) {
-						lengths_elt++;
-						index++;
-						lower_run = upper_run + 1;
-						lower_bound = lower_run;
-						upper_run += *lengths_elt;
-					} else {
-						break;
-					}
-				}
-				if (n == 0) {
-					REAL(ans)[i] = R_NaN;
-				} else if (REAL(ans)[i] != NA_REAL) {
-					REAL(ans)[i] /= n;
-				}
-			} else if (type == 'r') {
-				while (lower_run <= upper_bound) {
-					if (ISNAN(REAL(values)[index])) {
-						if (!LOGICAL(na_rm)[0]) {
-							REAL(ans)[i] = NA_REAL;
-							break;
-						}
-						n -=
-						    (1 + (upper_bound < upper_run ? upper_bound : upper_run) -
-						         (lower_bound > lower_run ? lower_bound : lower_run));
-					} else {
-						REAL(ans)[i] += REAL(values)[index] *
-						    (1 + (upper_bound < upper_run ? upper_bound : upper_run) -
-						         (lower_bound > lower_run ? lower_bound : lower_run));
-					}
-					if (index < max_index) {
-						lengths_elt++;
-						index++;
-						lower_run = upper_run + 1;
-						lower_bound = lower_run;
-						upper_run += *lengths_elt;
-					} else {
-						break;
-					}
-				}
-				if (n == 0) {
-					REAL(ans)[i] = R_NaN;
-				} else if (REAL(ans)[i] != NA_REAL) {
-					REAL(ans)[i] /= n;
-				}
-			} else if (type == 'c') {
-				while (lower_run <= upper_bound) {
-					if (ISNAN(COMPLEX(values)[index].r) || ISNAN(COMPLEX(values)[index].i)) {
-						if (!LOGICAL(na_rm)[0]) {
-							COMPLEX(ans)[i].r = NA_REAL;
-							COMPLEX(ans)[i].i = NA_REAL;
-							break;
-						}
-						n -=
-						    (1 + (upper_bound < upper_run ? upper_bound : upper_run) -
-						         (lower_bound > lower_run ? lower_bound : lower_run));
-					} else {
-						COMPLEX(ans)[i].r += COMPLEX(values)[index].r *
-						    (1 + (upper_bound < upper_run ? upper_bound : upper_run) -
-						         (lower_bound > lower_run ? lower_bound : lower_run));
-						COMPLEX(ans)[i].i += COMPLEX(values)[index].i *
-						    (1 + (upper_bound < upper_run ? upper_bound : upper_run) -
-						         (lower_bound > lower_run ? lower_bound : lower_run));
-					}
-					if (index < max_index) {
-						lengths_elt++;
-						index++;
-						lower_run = upper_run + 1;
-						lower_bound = lower_run;
-						upper_run += *lengths_elt;
-					} else {
-						break;
-					}
-				}
-				if (n == 0) {
-					COMPLEX(ans)[i].r = R_NaN;
-					COMPLEX(ans)[i].i = R_NaN;
-				} else if (COMPLEX(ans)[i].r != NA_REAL) {
-					COMPLEX(ans)[i].r /= n;
-					COMPLEX(ans)[i].i /= n;
-				}
+			rv = walk->rvalues[k];
+			if (ISNAN(rv)) {
+				if (!walk->narm)
+					return -1;
+				continue;
 			}
 		}
+		from = start > run_start ? start : run_start;
+		to = end < walk->run_ends[k] ? end : walk->run_ends[k];
+		buf[nbuf].value = rv;
+		buf[nbuf].weight = to - from + 1;
+		*n += buf[nbuf].weight;
+		nbuf++;
 	}
-	PROTECT(names = duplicate(_get_IRanges_names(ranges)));
+	return nbuf;
+}
+
+static int compare_weighted_values(const void *p1, const void *p2)
+{
+	double v1, v2;
+
+	v1 = ((const WeightedValue *) p1)->value;
+	v2 = ((const WeightedValue *) p2)->value;
+	return v1 < v2 ? -1 : v1 > v2 ? 1 : 0;
+}
+
+/* Sorts the runs by value and cumulates their nb of positions. */
+static void sort_view_runs(WeightedValue *buf, int nbuf)
+{
+	int j;
+
+	qsort(buf, nbuf, sizeof(WeightedValue), compare_weighted_values);
+	for (j = 1; j < nbuf; j++)
+		buf[j].weight += buf[j - 1].weight;
+	return;
+}
+
+/* Returns the value at position 'pos' (1-based) of the sorted values. */
+static double get_order_stat(const WeightedValue *buf, int nbuf, int pos)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = nbuf - 1;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (buf[mid].weight < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return buf[lo].value;
+}
+
+/*
+ * --- .Call ENTRY POINT ---
+ * Like median(), returns an integer vector if the subject contains integer
+ * values and the median of each view is one of its values (i.e. the nb of
+ * values in the view is odd) or NA. Otherwise returns a numeric vector.
+ */
+SEXP RleViews_viewMedians(SEXP x, SEXP na_rm)
+{
+	ViewsWalk walk;
+	WeightedValue *buf;
+	int i, nbuf, n, is_int;
+	double *medians, v1, v2;
+	SEXP ans, names;
+
+	prepare_views_runs(x, get_narm(na_rm), &walk);
+	buf = (WeightedValue *) R_alloc(walk.nrun, sizeof(WeightedValue));
+	medians = (double *) R_alloc(walk.nview, sizeof(double));
+	is_int = walk.type == 'i';
+	for (i = 0; i < walk.nview; i++) {
+		if (i % 100000 == 99999)
+			R_CheckUserInterrupt();
+		nbuf = collect_view_runs(&walk, i, buf, &n);
+		if (nbuf == -1 || n == 0) {
+			medians[i] = NA_REAL;
+			continue;
+		}
+		sort_view_runs(buf, nbuf);
+		if (n % 2 == 1) {
+			medians[i] = get_order_stat(buf, nbuf, n / 2 + 1);
+			continue;
+		}
+		v1 = get_order_stat(buf, nbuf, n / 2);
+		v2 = get_order_stat(buf, nbuf, n / 2 + 1);
+		medians[i] = (double) (((long double) v1 + v2) / 2.0L);
+		is_int = 0;
+	}
+	if (is_int) {
+		PROTECT(ans = NEW_INTEGER(walk.nview));
+		for (i = 0; i < walk.nview; i++)
+			INTEGER(ans)[i] = ISNAN(medians[i]) ? NA_INTEGER :
+					  (int) medians[i];
+	} else {
+		PROTECT(ans = NEW_NUMERIC(walk.nview));
+		for (i = 0; i < walk.nview; i++)
+			REAL(ans)[i] = medians[i];
+	}
+	PROTECT(names = duplicate(walk.ranges_holder.names));
 	SET_NAMES(ans, names);
 	UNPROTECT(2);
 	return ans;
@@ -569,232 +1834,131 @@ SEXP RleViews_viewMeans(SEXP x, SEXP na_rm)
 
 /*
  * --- .Call ENTRY POINT ---
+ * 'probs' must be a numeric vector with values in [0, 1]. Returns a
+ * numeric matrix with 1 row per view and 1 column per probability.
  */
-SEXP RleViews_viewWhichMins(SEXP x, SEXP na_rm)
+SEXP RleViews_viewQuantiles(SEXP x, SEXP na_rm, SEXP probs)
 {
-	char type = '?';
-	int i, start, width, ans_len, index,
-	    lower_run, upper_run, lower_bound, upper_bound;
-	int max_index, *ans_elt, *lengths_elt;
-	SEXP curr, ans, subject, values, lengths, ranges, names;
-	IRanges_holder ranges_holder;
-
-	subject = GET_SLOT(x, install("subject"));
-	values = GET_SLOT(subject, install("values"));
-	lengths = GET_SLOT(subject, install("lengths"));
-	ranges = GET_SLOT(x, install("ranges"));
-	ranges_holder = _hold_IRanges(ranges);
-	ans_len = _get_length_from_IRanges_holder(&ranges_holder);
-
-	curr = R_NilValue;
-	switch (TYPEOF(values)) {
-    case LGLSXP:
-    case INTSXP:
-		type = 'i';
-		PROTECT(curr = NEW_INTEGER(1));
-		break;
-    case REALSXP:
-		type = 'r';
-		PROTECT(curr = NEW_NUMERIC(1));
-		break;
-    default:
-		error("Rle must contain either 'integer' or 'numeric' values");
-    }
-
-	if (!IS_LOGICAL(na_rm) || LENGTH(na_rm) != 1 || LOGICAL(na_rm)[0] == NA_LOGICAL)
-		error("'na.rm' must be TRUE or FALSE");
+	ViewsWalk walk;
+	WeightedValue *buf;
+	int nprob, i, j, nbuf, n, lo, hi;
+	double *ans_p, index, qs, x_hi, h;
+	SEXP ans;
 
-	PROTECT(ans = NEW_INTEGER(ans_len));
-	lengths_elt = INTEGER(lengths);
-	max_index = LENGTH(lengths) - 1;
-	index = 0;
-	upper_run = *lengths_elt;
-	for (i = 0, ans_elt = INTEGER(ans); i < ans_len; i++, ans_elt++) {
+	prepare_views_runs(x, get_narm(na_rm), &walk);
+	nprob = LENGTH(probs);
+	buf = (WeightedValue *) R_alloc(walk.nrun, sizeof(WeightedValue));
+	PROTECT(ans = allocMatrix(REALSXP, walk.nview, nprob));
+	ans_p = REAL(ans);
+	for (i = 0; i < walk.nview; i++) {
 		if (i % 100000 == 99999)
 			R_CheckUserInterrupt();
-		start = _get_start_elt_from_IRanges_holder(&ranges_holder, i);
-		width = _get_width_elt_from_IRanges_holder(&ranges_holder, i);
-		*ans_elt = NA_INTEGER;
-		if (width > 0) {
-			if (type == 'i') {
-				INTEGER(curr)[0] = INT_MAX;
-			} else if (type == 'r') {
-				REAL(curr)[0] = R_PosInf;
-			}
-			while (index > 0 && upper_run > start) {
-				upper_run -= *lengths_elt;
-				lengths_elt--;
-				index--;
-			}
-			while (upper_run < start) {
-				lengths_elt++;
-				index++;
-				upper_run += *lengths_elt;
-			}
-			lower_run = upper_run - *lengths_elt + 1;
-			lower_bound = start;
-			upper_bound = start + width - 1;
-			if (type == 'i') {
-				while (lower_run <= upper_bound) {
-					if (INTEGER(values)[index] == NA_INTEGER) {
-						if (!LOGICAL(na_rm)[0]) {
-							break;
-						}
-					} else if (INTEGER(values)[index] < INTEGER(curr)[0]) {
-						*ans_elt = lower_bound;
-						INTEGER(curr)[0] = INTEGER(values)[index];
-					}
-					if (index < max_index) {
-						lengths_elt++;
-						index++;
-						lower_run = upper_run + 1;
-						lower_bound = lower_run;
-						upper_run += *lengths_elt;
-					} else {
-						break;
-					}
-				}
-			} else if (type == 'r') {
-				while (lower_run <= upper_bound) {
-					if (ISNAN(REAL(values)[index])) {
-						if (!LOGICAL(na_rm)[0]) {
-							break;
-						}
-					} else if (REAL(values)[index] < REAL(curr)[0]) {
-						*ans_elt = lower_bound;
-						REAL(curr)[0] = REAL(values)[index];
-					}
-					if (index < max_index) {
-						lengths_elt++;
-						index++;
-						lower_run = upper_run + 1;
-						lower_bound = lower_run;
-						upper_run += *lengths_elt;
-					} else {
-						break;
-					}
+		nbuf = collect_view_runs(&walk, i, buf, &n);
+		if (nbuf == -1 || n == 0) {
+			for (j = 0; j < nprob; j++)
+				ans_p[i + (R_xlen_t) walk.nview * j] = NA_REAL;
+			continue;
+		}
+		sort_view_runs(buf, nbuf);
+		for (j = 0; j < nprob; j++) {
+			/* Same as quantile(..., type=7). */
+			index = 1.0 + (n - 1) * REAL(probs)[j];
+			lo = (int) floor(index);
+			hi = (int) ceil(index);
+			qs = get_order_stat(buf, nbuf, lo);
+			if (index > lo) {
+				x_hi = get_order_stat(buf, nbuf, hi);
+				if (x_hi != qs) {
+					h = index - lo;
+					qs = (1 - h) * qs + h * x_hi;
 				}
 			}
+			ans_p[i + (R_xlen_t) walk.nview * j] = qs;
 		}
 	}
-	PROTECT(names = duplicate(_get_IRanges_names(ranges)));
-	SET_NAMES(ans, names);
-	UNPROTECT(3);
+	UNPROTECT(1);
 	return ans;
 }
 
 /*
  * --- .Call ENTRY POINT ---
+ * Computes the variances like var() i.e. with a 2-pass algorithm.
  */
-SEXP RleViews_viewWhichMaxs(SEXP x, SEXP na_rm)
+SEXP RleViews_viewVars(SEXP x, SEXP na_rm)
 {
-	char type = '?';
-	int i, start, width, ans_len, index,
-	    lower_run, upper_run, lower_bound, upper_bound;
-	int max_index, *ans_elt, *lengths_elt;
-	SEXP curr, ans, subject, values, lengths, ranges, names;
-	IRanges_holder ranges_holder;
+	ViewsWalk walk;
+	WeightedValue *buf;
+	int i, j, nbuf, n;
+	long double sum, mean;
+	double dev;
+	SEXP ans, names;
 
-	subject = GET_SLOT(x, install("subject"));
-	values = GET_SLOT(subject, install("values"));
-	lengths = GET_SLOT(subject, install("lengths"));
-	ranges = GET_SLOT(x, install("ranges"));
-	ranges_holder = _hold_IRanges(ranges);
-	ans_len = _get_length_from_IRanges_holder(&ranges_holder);
-
-	curr = R_NilValue;
-	switch (TYPEOF(values)) {
-    case LGLSXP:
-    case INTSXP:
-		type = 'i';
-		PROTECT(curr = NEW_INTEGER(1));
-		break;
-    case REALSXP:
-		type = 'r';
-		PROTECT(curr = NEW_NUMERIC(1));
-		break;
-    default:
-		error("Rle must contain either 'integer' or 'numeric' values");
-    }
+	prepare_views_runs(x, get_narm(na_rm), &walk);
+	buf = (WeightedValue *) R_alloc(walk.nrun, sizeof(WeightedValue));
+	PROTECT(ans = NEW_NUMERIC(walk.nview));
+	for (i = 0; i < walk.nview; i++) {
+		if (i % 100000 == 99999)
+			R_CheckUserInterrupt();
+		nbuf = collect_view_runs(&walk, i, buf, &n);
+		if (nbuf == -1 || n < 2) {
+			REAL(ans)[i] = NA_REAL;
+			continue;
+		}
+		sum = 0.0L;
+		for (j = 0; j < nbuf; j++)
+			sum += (long double) buf[j].value * buf[j].weight;
+		mean = sum / n;
+		if (R_FINITE((double) mean)) {
+			sum = 0.0L;
+			for (j = 0; j < nbuf; j++)
+				sum += (buf[j].value - mean) * buf[j].weight;
+			mean += sum / n;
+		}
+		sum = 0.0L;
+		for (j = 0; j < nbuf; j++) {
+			dev = buf[j].value - (double) mean;
+			sum += (long double) (dev * dev) * buf[j].weight;
+		}
+		REAL(ans)[i] = (double) (sum / (n - 1));
+	}
+	PROTECT(names = duplicate(walk.ranges_holder.names));
+	SET_NAMES(ans, names);
+	UNPROTECT(2);
+	return ans;
+}
 
-	if (!IS_LOGICAL(na_rm) || LENGTH(na_rm) != 1 || LOGICAL(na_rm)[0] == NA_LOGICAL)
-		error("'na.rm' must be TRUE or FALSE");
+/*
+ * --- .Call ENTRY POINT ---
+ * Counts the values > 'threshold' (a single number) in each view.
+ */
+SEXP RleViews_viewCountsAbove(SEXP x, SEXP threshold, SEXP na_rm)
+{
+	ViewsWalk walk;
+	WeightedValue *buf;
+	int i, j, nbuf, n, count;
+	double t;
+	SEXP ans, names;
 
-	PROTECT(ans = NEW_INTEGER(ans_len));
-	lengths_elt = INTEGER(lengths);
-	max_index = LENGTH(lengths) - 1;
-	index = 0;
-	upper_run = *lengths_elt;
-	for (i = 0, ans_elt = INTEGER(ans); i < ans_len; i++, ans_elt++) {
+	prepare_views_runs(x, get_narm(na_rm), &walk);
+	t = REAL(threshold)[0];
+	buf = (WeightedValue *) R_alloc(walk.nrun, sizeof(WeightedValue));
+	PROTECT(ans = NEW_INTEGER(walk.nview));
+	for (i = 0; i < walk.nview; i++) {
 		if (i % 100000 == 99999)
 			R_CheckUserInterrupt();
-		start = _get_start_elt_from_IRanges_holder(&ranges_holder, i);
-		width = _get_width_elt_from_IRanges_holder(&ranges_holder, i);
-		*ans_elt = NA_INTEGER;
-		if (width > 0) {
-			if (type == 'i') {
-				INTEGER(curr)[0] = R_INT_MIN;
-			} else if (type == 'r') {
-				REAL(curr)[0] = R_NegInf;
-			}
-			while (index > 0 && upper_run > start) {
-				upper_run -= *lengths_elt;
-				lengths_elt--;
-				index--;
-			}
-			while (upper_run < start) {
-				lengths_elt++;
-				index++;
-				upper_run += *lengths_elt;
-			}
-			lower_run = upper_run - *lengths_elt + 1;
-			lower_bound = start;
-			upper_bound = start + width - 1;
-			if (type == 'i') {
-				while (lower_run <= upper_bound) {
-					if (INTEGER(values)[index] == NA_INTEGER) {
-						if (!LOGICAL(na_rm)[0]) {
-							break;
-						}
-					} else if (INTEGER(values)[index] > INTEGER(curr)[0]) {
-						*ans_elt = lower_bound;
-						INTEGER(curr)[0] = INTEGER(values)[index];
-					}
-					if (index < max_index) {
-						lengths_elt++;
-						index++;
-						lower_run = upper_run + 1;
-						lower_bound = lower_run;
-						upper_run += *lengths_elt;
-					} else {
-						break;
-					}
-				}
-			} else if (type == 'r') {
-				while (lower_run <= upper_bound) {
-					if (ISNAN(REAL(values)[index])) {
-						if (!LOGICAL(na_rm)[0]) {
-							break;
-						}
-					} else if (REAL(values)[index] > REAL(curr)[0]) {
-						*ans_elt = lower_bound;
-						REAL(curr)[0] = REAL(values)[index];
-					}
-					if (index < max_index) {
-						lengths_elt++;
-						index++;
-						lower_run = upper_run + 1;
-						lower_bound = lower_run;
-						upper_run += *lengths_elt;
-					} else {
-						break;
-					}
-				}
-			}
+		nbuf = collect_view_runs(&walk, i, buf, &n);
+		if (nbuf == -1) {
+			INTEGER(ans)[i] = NA_INTEGER;
+			continue;
 		}
+		count = 0;
+		for (j = 0; j < nbuf; j++)
+			if (buf[j].value > t)
+				count += buf[j].weight;
+		INTEGER(ans)[i] = count;
 	}
-	PROTECT(names = duplicate(_get_IRanges_names(ranges)));
+	PROTECT(names = duplicate(walk.ranges_holder.names));
 	SET_NAMES(ans, names);
-	UNPROTECT(3);
+	UNPROTECT(2);
 	return ans;
 }
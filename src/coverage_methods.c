@@ -11,9 +11,20 @@
 #include "IRanges.h"
 #include "S4Vectors_interface.h"
 
-#include <stdlib.h> /* for qsort() */
+#include <stdlib.h> /* for malloc(), calloc(), free() */
+#include <math.h> /* for log2() */
 #include <R_ext/Utils.h> /* for R_CheckUserInterrupt() */
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 static const char *x_label, *shift_label, *width_label, *weight_label;
 
@@ -27,6 +38,123 @@ static void check_recycling_was_round(int last_pos_in_current, int current_len,
 }
 
 
+/****************************************************************************
+ * Coverage jobs.
+ *
+ * The coverage of a set of ranges is computed in 2 steps:
+ *   1. A CoverageJob struct is prepared on the main thread (this is where
+ *      the arguments are checked and the ranges are shifted and clipped).
+ *   2. The job is run. This computes the coverage as a sequence of runs in
+ *      malloc'ed buffers and doesn't use the R API, so several jobs can be
+ *      run concurrently (see CompressedIRangesList_coverage()).
+ * Then the Rle object is constructed from the runs on the main thread.
+ */
+
+#define	COVERAGE_OK 0
+#define	COVERAGE_ALLOC_FAILED 1
+#define	COVERAGE_INTERRUPTED 2
+
+/* The runs can have a length of 0 and adjacent runs can have the same value
+   (construct_integer_Rle() and construct_numeric_Rle() take care of this). */
+typedef struct coverage_runs_t {
+	int nrun;
+	int *lengths;
+	int *int_values;
+	double *double_values;
+	int ovflow;  /* set to 1 if an integer overflow occurred */
+	int status;  /* COVERAGE_OK, COVERAGE_ALLOC_FAILED, or
+			COVERAGE_INTERRUPTED */
+} CoverageRuns;
+
+typedef struct coverage_job_t {
+	const int *x_start, *x_width;  /* the shifted and clipped ranges */
+	int x_len;
+	const int *int_weight;  /* NULL if the weights are doubles */
+	const double *double_weight;
+	int weight_len;
+	int cvg_len;
+	int method;  /* 1 for "sort", 2 for "hash", 3 for "blocked" */
+	int check_interrupt;  /* can only be 1 when run on the main thread */
+	CoverageRuns out;
+} CoverageJob;
+
+static void check_interrupt_fun(void *data)
+{
+	R_CheckUserInterrupt();
+}
+
+/* Unlike R_CheckUserInterrupt(), doesn't longjmp. */
+static int user_interrupted(CoverageJob *job, int i)
+{
+	if (!job->check_interrupt || i % 500000 != 499999)
+		return 0;
+	if (R_ToplevelExec(check_interrupt_fun, NULL))
+		return 0;
+	job->out.status = COVERAGE_INTERRUPTED;
+	return 1;
+}
+
+/* Same as safe_int_add() but thread-safe. */
+static int add_ints(int x, int y, int *ovflow)
+{
+	long long int z;
+
+	if (x == NA_INTEGER || y == NA_INTEGER)
+		return NA_INTEGER;
+	z = (long long int) x + y;
+	if (z > INT_MAX || z <= INT_MIN) {
+		*ovflow = 1;
+		return NA_INTEGER;
+	}
+	return (int) z;
+}
+
+static int alloc_coverage_runs(CoverageJob *job, int nrun)
+{
+	CoverageRuns *out;
+	size_t n;
+
+	out = &(job->out);
+	out->nrun = nrun;
+	n = nrun != 0 ? (size_t) nrun : 1;  /* never call malloc(0) */
+	out->lengths = (int *) malloc(sizeof(int) * n);
+	if (job->int_weight != NULL)
+		out->int_values = (int *) malloc(sizeof(int) * n);
+	else
+		out->double_values = (double *) malloc(sizeof(double) * n);
+	if (out->lengths == NULL
+	 || (out->int_values == NULL && out->double_values == NULL))
+	{
+		out->status = COVERAGE_ALLOC_FAILED;
+		return 0;
+	}
+	return 1;
+}
+
+static void free_coverage_runs(CoverageRuns *out)
+{
+	free(out->lengths);
+	free(out->int_values);
+	free(out->double_values);
+	out->lengths = out->int_values = NULL;
+	out->double_values = NULL;
+	return;
+}
+
+/* A single run of 0's. */
+static void set_zero_coverage(CoverageJob *job)
+{
+	if (!alloc_coverage_runs(job, 1))
+		return;
+	job->out.lengths[0] = job->cvg_len;
+	if (job->int_weight != NULL)
+		job->out.int_values[0] = 0;
+	else
+		job->out.double_values[0] = 0.0;
+	return;
+}
+
+
 /****************************************************************************
  *                              "sort" method                               *
  ****************************************************************************/
@@ -38,28 +166,6 @@ static void check_recycling_was_round(int last_pos_in_current, int current_len,
 #define SEid_TO_1BASED_INDEX(SEid) ((SEid) >= 0 ? (SEid) : -(SEid))
 #define SEid_IS_END(SEid) ((SEid) >= 0)
 
-static const int *base_start;
-static const int *base_width;
-
-static int compar_SEids_for_asc_order(const void *p1, const void *p2)
-{
-	int SEid1, SEid2, index1, index2, s1, s2;
-
-	SEid1 = *((const int *) p1);
-	SEid2 = *((const int *) p2);
-	index1 = SEid_TO_1BASED_INDEX(SEid1);
-	index2 = SEid_TO_1BASED_INDEX(SEid2);
-	/* If SEid is a Start id, then s = start
-	   If SEid is an End id, then s = end + 1 */
-	s1 = base_start[index1];
-	if (SEid_IS_END(SEid1))
-		s1 += base_width[index1];
-	s2 = base_start[index2];
-	if (SEid_IS_END(SEid2))
-		s2 += base_width[index2];
-	return s1 - s2;
-}
-
 /* Initialize the SEids buffer (integer weights). */
 static int init_SEids_int_weight(int *SEids, const int *x_width, int x_len,
 		const int *weight, int weight_len)
@@ -76,7 +182,6 @@ static int init_SEids_int_weight(int *SEids, const int *x_width, int x_len,
 		*(SEids++) = - index; /* End id */
 		SEids_len += 2;
 	}
-	check_recycling_was_round(j, weight_len, weight_label, x_label);
 	return SEids_len;
 }
 
@@ -96,39 +201,105 @@ static int init_SEids_double_weight(int *SEids, const int *x_width, int x_len,
 		*(SEids++) = - index; /* End id */
 		SEids_len += 2;
 	}
-	check_recycling_was_round(j, weight_len, weight_label, x_label);
 	return SEids_len;
 }
 
-/* Sort the SEids buffer. */
-static void sort_SEids(int *SEids, int SEids_len,
+/*
+ * Sort 64-bit keys by their upper 32 bits (seen as an unsigned int) with an
+ * LSD radix sort on the 4 bytes. The sort is stable and a pass is skipped
+ * when all the keys have the same byte (which is always the case for the
+ * high bytes on short sequences). 'keys2' is a buffer of the same length
+ * as 'keys'. Returns a pointer to the sorted keys (either 'keys' or
+ * 'keys2').
+ */
+static unsigned long long *radix_sort_keys(unsigned long long *keys,
+		unsigned long long *keys2, int nkey)
+{
+	unsigned long long *tmp;
+	int count[256], i, shift, b, n;
+
+	for (shift = 32; shift < 64; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < nkey; i++)
+			count[(keys[i] >> shift) & 0xff]++;
+		if (count[(keys[0] >> shift) & 0xff] == nkey)
+			continue;  /* all the keys have the same byte */
+		for (b = n = 0; b < 256; b++) {
+			i = count[b];
+			count[b] = n;
+			n += i;
+		}
+		for (i = 0; i < nkey; i++)
+			keys2[count[(keys[i] >> shift) & 0xff]++] = keys[i];
+		tmp = keys;
+		keys = keys2;
+		keys2 = tmp;
+	}
+	return keys;
+}
+
+/*
+ * Sort the SEids buffer by ascending event position i.e. by 'start' for a
+ * Start id and by 'end + 1' for an End id.
+ * Each SEid is packed with its event position in a 64-bit key (position in
+ * the upper 32 bits) and the keys are sorted with radix_sort_keys().
+ * Returns 0 if memory allocation failed and 1 otherwise.
+ */
+static int sort_SEids(int *SEids, int SEids_len,
 		const int *x_start, const int *x_width)
 {
-	base_start = x_start - 1;
-	base_width = x_width - 1;
-	qsort(SEids, SEids_len, sizeof(int), compar_SEids_for_asc_order);
-	return;
+	unsigned long long *keys, *keys2, *sorted_keys;
+	int i, SEid, index, pos;
+
+	keys = (unsigned long long *)
+		malloc(sizeof(unsigned long long) * (size_t) SEids_len);
+	keys2 = (unsigned long long *)
+		malloc(sizeof(unsigned long long) * (size_t) SEids_len);
+	if (keys == NULL || keys2 == NULL) {
+		free(keys);
+		free(keys2);
+		return 0;
+	}
+	for (i = 0; i < SEids_len; i++) {
+		SEid = SEids[i];
+		index = SEid_TO_1BASED_INDEX(SEid) - 1;
+		pos = x_start[index];
+		if (SEid_IS_END(SEid))
+			pos += x_width[index];
+		keys[i] = ((unsigned long long) (unsigned int) pos << 32) |
+			  (unsigned int) SEid;
+	}
+	sorted_keys = radix_sort_keys(keys, keys2, SEids_len);
+	for (i = 0; i < SEids_len; i++)
+		SEids[i] = (int) (unsigned int) (sorted_keys[i] & 0xffffffffU);
+	free(keys);
+	free(keys2);
+	return 1;
 }
 
+
 /****************************************************************************
  * int_coverage_sort(), double_coverage_sort()
  */
 
 /* 'values_buf' and 'lengths_buf' must have a length >= SEids_len + 1 */
-static void compute_int_coverage_in_bufs(const int *SEids, int SEids_len,
-		const int *x_start, const int *x_width,
-		const int *weight, int weight_len, int cvg_len,
+static void compute_int_coverage_in_bufs(CoverageJob *job,
+		const int *SEids, int SEids_len,
 		int *values_buf, int *lengths_buf)
 {
-	int curr_val, curr_weight,
+	const int *x_start, *x_width, *weight;
+	int weight_len, curr_val, curr_weight,
 	    curr_pos, i, prev_pos, index;
 
+	x_start = job->x_start;
+	x_width = job->x_width;
+	weight = job->int_weight;
+	weight_len = job->weight_len;
 	*(values_buf++) = curr_val = 0;
 	curr_pos = 1;
-	reset_ovflow_flag(); /* we use safe_int_add() in loop below */
 	for (i = 0; i < SEids_len; i++, SEids++) {
-		if (i % 500000 == 499999)
-			R_CheckUserInterrupt();
+		if (user_interrupted(job, i))
+			return;
 		prev_pos = curr_pos;
 		index = SEid_TO_1BASED_INDEX(*SEids) - 1;
 		curr_pos = x_start[index];
@@ -137,29 +308,32 @@ static void compute_int_coverage_in_bufs(const int *SEids, int SEids_len,
 			curr_weight = - curr_weight;
 			curr_pos += x_width[index];
 		}
-		curr_val = safe_int_add(curr_val, curr_weight);
+		curr_val = add_ints(curr_val, curr_weight, &(job->out.ovflow));
 		*(values_buf++) = curr_val;
 		*(lengths_buf++) = curr_pos - prev_pos;
 	}
-	if (get_ovflow_flag())
-		warning("NAs produced by integer overflow");
-	*lengths_buf = cvg_len + 1 - curr_pos;
+	*lengths_buf = job->cvg_len + 1 - curr_pos;
 	return;
 }
 
-static void compute_double_coverage_in_bufs(const int *SEids, int SEids_len,
-		const int *x_start, const int *x_width,
-		const double *weight, int weight_len, int cvg_len,
+static void compute_double_coverage_in_bufs(CoverageJob *job,
+		const int *SEids, int SEids_len,
 		double *values_buf, int *lengths_buf)
 {
+	const int *x_start, *x_width;
+	const double *weight;
 	double curr_val, curr_weight;
-	int curr_pos, i, prev_pos, index;
+	int weight_len, curr_pos, i, prev_pos, index;
 
+	x_start = job->x_start;
+	x_width = job->x_width;
+	weight = job->double_weight;
+	weight_len = job->weight_len;
 	*(values_buf++) = curr_val = 0.0;
 	curr_pos = 1;
 	for (i = 0; i < SEids_len; i++, SEids++) {
-		if (i % 500000 == 499999)
-			R_CheckUserInterrupt();
+		if (user_interrupted(job, i))
+			return;
 		prev_pos = curr_pos;
 		index = SEid_TO_1BASED_INDEX(*SEids) - 1;
 		curr_pos = x_start[index];
@@ -172,124 +346,348 @@ static void compute_double_coverage_in_bufs(const int *SEids, int SEids_len,
 		*(values_buf++) = curr_val;
 		*(lengths_buf++) = curr_pos - prev_pos;
 	}
-	*lengths_buf = cvg_len + 1 - curr_pos;
+	*lengths_buf = job->cvg_len + 1 - curr_pos;
 	return;
 }
 
-static SEXP int_coverage_sort(const int *x_start, const int *x_width,
-		int x_len, const int *weight, int weight_len,
-		int cvg_len)
+static void coverage_sort(CoverageJob *job)
 {
-	int *SEids, SEids_len, zero, buf_len, *values_buf, *lengths_buf;
+	int *SEids, SEids_len;
 
-	SEids = (int *) R_alloc((long) 2 * x_len, sizeof(int));
-	SEids_len = init_SEids_int_weight(SEids, x_width, x_len,
-					  weight, weight_len);
+	/* + 1 so we never call malloc(0) */
+	SEids = (int *) malloc(sizeof(int) * (2 * (size_t) job->x_len + 1));
+	if (SEids == NULL) {
+		job->out.status = COVERAGE_ALLOC_FAILED;
+		return;
+	}
+	SEids_len = job->int_weight != NULL ?
+		init_SEids_int_weight(SEids, job->x_width, job->x_len,
+				      job->int_weight, job->weight_len) :
+		init_SEids_double_weight(SEids, job->x_width, job->x_len,
+					 job->double_weight, job->weight_len);
 	if (SEids_len == 0) {
-		//return an Rle with one run of 0's
-		zero = 0;
-		return construct_integer_Rle(&zero, 1, &cvg_len, 0);
-	}
-	sort_SEids(SEids, SEids_len, x_start, x_width);
-	buf_len = SEids_len + 1;
-	values_buf = (int *) R_alloc((long) buf_len, sizeof(int));
-	lengths_buf = (int *) R_alloc((long) buf_len, sizeof(int));
-	compute_int_coverage_in_bufs(SEids, SEids_len,
-			x_start, x_width, weight, weight_len, cvg_len,
-			values_buf, lengths_buf);
-	return construct_integer_Rle(values_buf, buf_len, lengths_buf, 0);
-}
-
-static SEXP double_coverage_sort(const int *x_start, const int *x_width,
-		int x_len, const double *weight, int weight_len,
-		int cvg_len)
+		free(SEids);
+		set_zero_coverage(job);
+		return;
+	}
+	if (!sort_SEids(SEids, SEids_len, job->x_start, job->x_width)
+	 || !alloc_coverage_runs(job, SEids_len + 1))
+	{
+		free(SEids);
+		job->out.status = COVERAGE_ALLOC_FAILED;
+		return;
+	}
+	if (job->int_weight != NULL)
+		compute_int_coverage_in_bufs(job, SEids, SEids_len,
+				job->out.int_values, job->out.lengths);
+	else
+		compute_double_coverage_in_bufs(job, SEids, SEids_len,
+				job->out.double_values, job->out.lengths);
+	free(SEids);
+	return;
+}
+
+
+/****************************************************************************
+ *                              "hash" method                               *
+ ****************************************************************************/
+
+/*
+ * The dense buffer is processed in blocks small enough to stay in the L1
+ * cache: the cumulative sum of a block is computed (with SIMD instructions
+ * when available) then its runs are extracted right away.
+ */
+
+#define	PREFIX_SUM_BLOCK_LEN 2048
+
+/* The number of runs is at most the number of distinct event positions
+   + 1. */
+static int max_nrun(const CoverageJob *job)
 {
-	int *SEids, SEids_len, buf_len, *lengths_buf;
-	double zero, *values_buf;
+	long long int nrun;
 
-	SEids = (int *) R_alloc((long) 2 * x_len, sizeof(int));
-	SEids_len = init_SEids_double_weight(SEids, x_width, x_len,
-					     weight, weight_len);
-	if (SEids_len == 0) {
-		//return an Rle with one run of 0's
-		zero = 0.0;
-		return construct_numeric_Rle(&zero, 1, &cvg_len, 0);
+	nrun = 2LL * job->x_len + 1;
+	return nrun < job->cvg_len ? (int) nrun : job->cvg_len;
+}
+
+/* Same as the comparison used by construct_numeric_Rle(): NAs are equal to
+   NAs and NaNs to NaNs. Otherwise the NA and NaN stretches of the coverage
+   (e.g. with NA weights) would start a new run at each position. */
+static inline int same_double(double x, double y)
+{
+	return x == y || (R_IsNA(x) && R_IsNA(y)) ||
+	       (R_IsNaN(x) && R_IsNaN(y));
+}
+
+/* Returns 1 if the cumulative sum of the 'n' ints in 'buf' (starting from
+   'cumsum') can be computed without checking each addition i.e. if there
+   are no NAs and no integer overflow can occur. */
+static int int_block_is_safe(const int *buf, int n, int cumsum)
+{
+	long long int bound;
+	int has_NA, i;
+
+	if (cumsum == NA_INTEGER)
+		return 0;
+	bound = cumsum >= 0 ? cumsum : - (long long int) cumsum;
+	has_NA = 0;
+	for (i = 0; i < n; i++) {
+		has_NA |= buf[i] == NA_INTEGER;
+		bound += buf[i] >= 0 ? buf[i] : - (long long int) buf[i];
 	}
-	sort_SEids(SEids, SEids_len, x_start, x_width);
-	buf_len = SEids_len + 1;
-	values_buf = (double *) R_alloc((long) buf_len, sizeof(double));
-	lengths_buf = (int *) R_alloc((long) buf_len, sizeof(int));
-	compute_double_coverage_in_bufs(SEids, SEids_len,
-			x_start, x_width, weight, weight_len, cvg_len,
-			values_buf, lengths_buf);
-	return construct_numeric_Rle(values_buf, buf_len, lengths_buf, 0);
+	return !has_NA && bound <= INT_MAX;
 }
 
-static SEXP coverage_sort(const int *x_start, const int *x_width, int x_len,
-		SEXP weight, int cvg_len)
+/* In-place cumulative sum of the 'n' ints in 'buf' starting from 'cumsum'.
+   The block must have passed int_block_is_safe(). Returns the last
+   value. */
+static int int_prefix_sum_block(int *buf, int n, int cumsum)
 {
-	int weight_len;
+	int i;
+
+	i = 0;
+#if defined(__AVX2__)
+	{
+		__m256i x, carry, lane3, last;
+
+		carry = _mm256_set1_epi32(cumsum);
+		lane3 = _mm256_set1_epi32(3);
+		last = _mm256_set1_epi32(7);
+		for ( ; i + 8 <= n; i += 8) {
+			x = _mm256_loadu_si256((const __m256i *) (buf + i));
+			/* prefix sums within each 128-bit lane */
+			x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+			x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+			/* add the total of the low lane to the high lane */
+			x = _mm256_add_epi32(x, _mm256_blend_epi32(
+				_mm256_setzero_si256(),
+				_mm256_permutevar8x32_epi32(x, lane3), 0xF0));
+			x = _mm256_add_epi32(x, carry);
+			_mm256_storeu_si256((__m256i *) (buf + i), x);
+			carry = _mm256_permutevar8x32_epi32(x, last);
+		}
+		cumsum = _mm_cvtsi128_si32(_mm256_castsi256_si128(carry));
+	}
+#elif defined(__SSE2__)
+	{
+		__m128i x, carry;
+
+		carry = _mm_set1_epi32(cumsum);
+		for ( ; i + 4 <= n; i += 4) {
+			x = _mm_loadu_si128((const __m128i *) (buf + i));
+			x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+			x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+			x = _mm_add_epi32(x, carry);
+			_mm_storeu_si128((__m128i *) (buf + i), x);
+			carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+		}
+		cumsum = _mm_cvtsi128_si32(carry);
+	}
+#endif
+	for ( ; i < n; i++)
+		buf[i] = cumsum += buf[i];
+	return cumsum;
+}
 
-	weight_len = LENGTH(weight);
-	return IS_INTEGER(weight) ?
-	       int_coverage_sort(x_start, x_width, x_len,
-				INTEGER(weight), weight_len, cvg_len) :
-	       double_coverage_sort(x_start, x_width, x_len,
-				REAL(weight), weight_len, cvg_len);
+/* Same as int_prefix_sum_block() but each addition is checked. */
+static int int_checked_prefix_sum_block(int *buf, int n, int cumsum,
+		int *ovflow)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		buf[i] = cumsum = add_ints(buf[i], cumsum, ovflow);
+	return cumsum;
 }
 
+/* Append the values 'cvg_buf[from]' to 'cvg_buf[to - 1]' to the runs in
+   'out' (the last run is extended when the value doesn't change).
+   'from' must be >= 1. */
+static inline void append_int_values_to_runs(CoverageRuns *out,
+		const int *cvg_buf, int from, int to)
+{
+	int j;
 
-/****************************************************************************
- *                              "hash" method                               *
- ****************************************************************************/
+	for (j = from; j < to; j++) {
+		if (cvg_buf[j] != cvg_buf[j - 1]) {
+			out->int_values[out->nrun] = cvg_buf[j];
+			out->lengths[out->nrun++] = 1;
+		} else {
+			out->lengths[out->nrun - 1]++;
+		}
+	}
+	return;
+}
 
-static SEXP int_coverage_hash(
-		const int *x_start, const int *x_width, int x_len,
-		const int *weight, int weight_len,
-		int cvg_len)
+static inline void append_double_values_to_runs(CoverageRuns *out,
+		const double *cvg_buf, int from, int to)
 {
-	int *cvg_buf, *cvg_p, w, cumsum,
-	    i, j;
+	int j;
 
-	cvg_buf = (int *) R_alloc((long) cvg_len + 1, sizeof(int));
-	memset(cvg_buf, 0, cvg_len * sizeof(int));
-	reset_ovflow_flag(); /* we use safe_int_add() in loop below */
-	for (i = j = 0; i < x_len; i++, j++, x_start++, x_width++) {
-		if (i % 500000 == 499999)
-			R_CheckUserInterrupt();
+	for (j = from; j < to; j++) {
+		if (!same_double(cvg_buf[j], cvg_buf[j - 1])) {
+			out->double_values[out->nrun] = cvg_buf[j];
+			out->lengths[out->nrun++] = 1;
+		} else {
+			out->lengths[out->nrun - 1]++;
+		}
+	}
+	return;
+}
+
+/* Append the 'n' values starting at 'cvg_buf[offset]' to the runs in
+   'job->out'. The stretches of identical values are detected with SIMD
+   instructions when available. 'job->out.nrun' must be 0 when 'offset'
+   is 0. */
+static void int_block_to_runs(CoverageJob *job, const int *cvg_buf,
+		int offset, int n)
+{
+	CoverageRuns *out;
+	int i, end;
+
+	out = &(job->out);
+	i = offset;
+	end = offset + n;
+	if (i == 0) {
+		out->int_values[0] = cvg_buf[0];
+		out->lengths[0] = 1;
+		out->nrun = 1;
+		i = 1;
+	}
+#if defined(__AVX2__)
+	for ( ; i + 8 <= end; i += 8) {
+		__m256i x, y;
+
+		x = _mm256_loadu_si256((const __m256i *) (cvg_buf + i));
+		y = _mm256_loadu_si256((const __m256i *) (cvg_buf + i - 1));
+		if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(x, y)) == -1)
+			out->lengths[out->nrun - 1] += 8;
+		else
+			append_int_values_to_runs(out, cvg_buf, i, i + 8);
+	}
+#elif defined(__SSE2__)
+	for ( ; i + 4 <= end; i += 4) {
+		__m128i x, y;
+
+		x = _mm_loadu_si128((const __m128i *) (cvg_buf + i));
+		y = _mm_loadu_si128((const __m128i *) (cvg_buf + i - 1));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(x, y)) == 0xffff)
+			out->lengths[out->nrun - 1] += 4;
+		else
+			append_int_values_to_runs(out, cvg_buf, i, i + 4);
+	}
+#endif
+	append_int_values_to_runs(out, cvg_buf, i, end);
+	return;
+}
+
+static void double_block_to_runs(CoverageJob *job, const double *cvg_buf,
+		int offset, int n)
+{
+	CoverageRuns *out;
+	int i, end;
+
+	out = &(job->out);
+	i = offset;
+	end = offset + n;
+	if (i == 0) {
+		out->double_values[0] = cvg_buf[0];
+		out->lengths[0] = 1;
+		out->nrun = 1;
+		i = 1;
+	}
+#if defined(__SSE2__)
+	for ( ; i + 2 <= end; i += 2) {
+		__m128d x, y;
+
+		x = _mm_loadu_pd(cvg_buf + i);
+		y = _mm_loadu_pd(cvg_buf + i - 1);
+		/* NaNs never compare equal here so their stretches go thru
+		   append_double_values_to_runs(). */
+		if (_mm_movemask_pd(_mm_cmpeq_pd(x, y)) == 3)
+			out->lengths[out->nrun - 1] += 2;
+		else
+			append_double_values_to_runs(out, cvg_buf, i, i + 2);
+	}
+#endif
+	append_double_values_to_runs(out, cvg_buf, i, end);
+	return;
+}
+
+static void int_coverage_hash(CoverageJob *job)
+{
+	const int *x_start, *x_width, *weight;
+	int *cvg_buf, *cvg_p, *ovflow, weight_len, w, cumsum,
+	    i, j, n;
+
+	cvg_buf = (int *) calloc((size_t) job->cvg_len + 1, sizeof(int));
+	if (cvg_buf == NULL) {
+		job->out.status = COVERAGE_ALLOC_FAILED;
+		return;
+	}
+	x_start = job->x_start;
+	x_width = job->x_width;
+	weight = job->int_weight;
+	weight_len = job->weight_len;
+	ovflow = &(job->out.ovflow);
+	for (i = j = 0; i < job->x_len; i++, j++, x_start++, x_width++) {
+		if (user_interrupted(job, i)) {
+			free(cvg_buf);
+			return;
+		}
 		if (j >= weight_len)
 			j = 0; /* recycle j */
 		cvg_p = cvg_buf + *x_start - 1;
 		w = weight[j];
-		*cvg_p = safe_int_add(*cvg_p, w);
+		*cvg_p = add_ints(*cvg_p, w, ovflow);
 		cvg_p += *x_width;
-		*cvg_p = safe_int_add(*cvg_p, - w);
+		*cvg_p = add_ints(*cvg_p, w == NA_INTEGER ? w : - w, ovflow);
+	}
+	if (!alloc_coverage_runs(job, max_nrun(job))) {
+		free(cvg_buf);
+		return;
 	}
-	check_recycling_was_round(j, weight_len, weight_label, x_label);
+	job->out.nrun = 0;
 	cumsum = 0;
-	for (i = 0, cvg_p = cvg_buf; i < cvg_len; i++, cvg_p++) {
-		cumsum = safe_int_add(*cvg_p, cumsum);
-		*cvg_p = cumsum;
+	for (i = 0; i < job->cvg_len; i += n) {
+		n = job->cvg_len - i;
+		if (n > PREFIX_SUM_BLOCK_LEN)
+			n = PREFIX_SUM_BLOCK_LEN;
+		cvg_p = cvg_buf + i;
+		if (int_block_is_safe(cvg_p, n, cumsum))
+			cumsum = int_prefix_sum_block(cvg_p, n, cumsum);
+		else
+			cumsum = int_checked_prefix_sum_block(cvg_p, n, cumsum,
+							      ovflow);
+		int_block_to_runs(job, cvg_buf, i, n);
 	}
-	if (get_ovflow_flag())
-		warning("NAs produced by integer overflow");
-	return construct_integer_Rle(cvg_buf, cvg_len, NULL, 0);
+	free(cvg_buf);
+	return;
 }
 
-static SEXP double_coverage_hash(
-		const int *x_start, const int *x_width, int x_len,
-		const double *weight, int weight_len,
-		int cvg_len)
+/* The cumulative sum of the doubles is not vectorized: this would change
+   the order of the additions and so the rounding of the result. */
+static void double_coverage_hash(CoverageJob *job)
 {
+	const int *x_start, *x_width;
+	const double *weight;
 	double *cvg_buf, *cvg_p, w, cumsum;
-	int i, j;
+	int weight_len, i, j, n, k;
 
-	cvg_buf = (double *) R_alloc((long) cvg_len + 1, sizeof(double));
-	for (i = 0, cvg_p = cvg_buf; i < cvg_len; i++, cvg_p++)
-		*cvg_p = 0.0;
-	for (i = j = 0; i < x_len; i++, j++, x_start++, x_width++) {
-		if (i % 500000 == 499999)
-			R_CheckUserInterrupt();
+	cvg_buf = (double *) calloc((size_t) job->cvg_len + 1, sizeof(double));
+	if (cvg_buf == NULL) {
+		job->out.status = COVERAGE_ALLOC_FAILED;
+		return;
+	}
+	x_start = job->x_start;
+	x_width = job->x_width;
+	weight = job->double_weight;
+	weight_len = job->weight_len;
+	for (i = j = 0; i < job->x_len; i++, j++, x_start++, x_width++) {
+		if (user_interrupted(job, i)) {
+			free(cvg_buf);
+			return;
+		}
 		if (j >= weight_len)
 			j = 0; /* recycle j */
 		cvg_p = cvg_buf + *x_start - 1;
@@ -298,154 +696,771 @@ static SEXP double_coverage_hash(
 		cvg_p += *x_width;
 		*cvg_p -= w;
 	}
-	check_recycling_was_round(j, weight_len, weight_label, x_label);
+	if (!alloc_coverage_runs(job, max_nrun(job))) {
+		free(cvg_buf);
+		return;
+	}
+	job->out.nrun = 0;
 	cumsum = 0.0;
-	for (i = 0, cvg_p = cvg_buf; i < cvg_len; i++, cvg_p++) {
-		cumsum += *cvg_p;
-		*cvg_p = cumsum;
+	for (i = 0; i < job->cvg_len; i += n) {
+		n = job->cvg_len - i;
+		if (n > PREFIX_SUM_BLOCK_LEN)
+			n = PREFIX_SUM_BLOCK_LEN;
+		for (k = 0, cvg_p = cvg_buf + i; k < n; k++, cvg_p++) {
+			cumsum += *cvg_p;
+			*cvg_p = cumsum;
+		}
+		double_block_to_runs(job, cvg_buf, i, n);
 	}
-	return construct_numeric_Rle(cvg_buf, cvg_len, NULL, 0);
+	free(cvg_buf);
+	return;
 }
 
-static SEXP coverage_hash(const int *x_start, const int *x_width, int x_len,
-		SEXP weight, int cvg_len)
+static void coverage_hash(CoverageJob *job)
 {
-	int weight_len;
-
-	weight_len = LENGTH(weight);
-	return IS_INTEGER(weight) ?
-	       int_coverage_hash(x_start, x_width, x_len,
-				INTEGER(weight), weight_len, cvg_len) :
-	       double_coverage_hash(x_start, x_width, x_len,
-				REAL(weight), weight_len, cvg_len);
+	if (job->int_weight != NULL)
+		int_coverage_hash(job);
+	else
+		double_coverage_hash(job);
+	return;
 }
 
 
 /****************************************************************************
- * Helper functions for checking args of type SEXP.                         *
- * They either pass (and return nothing) or raise an error with an          *
- * informative message.                                                     *
+ *                             "blocked" method                             *
  ****************************************************************************/
 
-static void check_arg_is_integer(SEXP arg, const char *arg_label)
+/*
+ * Same as the "hash" method except that the coordinate axis is processed in
+ * tiles of at most COVERAGE_TILE_LEN positions, so the dense buffer has a
+ * fixed size whatever 'cvg_len' is. The ranges are walked by ascending
+ * start. When the end of a range doesn't fall in the tile where the range
+ * starts, it's kept in a min-heap until the tile that contains it is
+ * processed. The stretches of the axis that contain no start or end are
+ * emitted as a single run without being visited, so sparse inputs are
+ * processed in a time that depends on the number of ranges, not on
+ * 'cvg_len'.
+ */
+
+#define	COVERAGE_TILE_LEN 65536
+
+/* Min-heap of the ends ('end + 1') of the ranges that started in a previous
+   tile. */
+typedef struct pending_ends_t {
+	int buflength;
+	int nelt;
+	int *pos;
+	int *windex;  /* index of the weight of the range in 'job->*_weight' */
+} PendingEnds;
+
+static int init_pending_ends(PendingEnds *ends, int buflength)
 {
-	if (!IS_INTEGER(arg))
-		error("'%s' must be an integer vector", arg_label);
-	return;
+	ends->buflength = buflength;
+	ends->nelt = 0;
+	ends->pos = (int *) malloc(sizeof(int) * (size_t) buflength);
+	ends->windex = (int *) malloc(sizeof(int) * (size_t) buflength);
+	return ends->pos != NULL && ends->windex != NULL;
 }
 
-static void check_arg_is_numeric(SEXP arg, const char *arg_label)
+static void free_pending_ends(PendingEnds *ends)
 {
-	if (!(IS_INTEGER(arg) || IS_NUMERIC(arg)))
-		error("'%s' must be an integer or numeric vector", arg_label);
+	free(ends->pos);
+	free(ends->windex);
 	return;
 }
 
-static void check_arg_is_list(SEXP arg, const char *arg_label)
+/* Returns 0 if memory allocation failed and 1 otherwise. */
+static int push_pending_end(PendingEnds *ends, int pos, int windex)
 {
-	if (!IS_LIST(arg))
-		error("'%s' must be a list", arg_label);
-	return;
+	int *new_pos, *new_windex, k, parent;
+
+	if (ends->nelt == ends->buflength) {
+		new_pos = (int *) realloc(ends->pos,
+				sizeof(int) * 2 * (size_t) ends->buflength);
+		if (new_pos == NULL)
+			return 0;
+		ends->pos = new_pos;
+		new_windex = (int *) realloc(ends->windex,
+				sizeof(int) * 2 * (size_t) ends->buflength);
+		if (new_windex == NULL)
+			return 0;
+		ends->windex = new_windex;
+		ends->buflength *= 2;
+	}
+	for (k = ends->nelt++; k > 0; k = parent) {
+		parent = (k - 1) / 2;
+		if (ends->pos[parent] <= pos)
+			break;
+		ends->pos[k] = ends->pos[parent];
+		ends->windex[k] = ends->windex[parent];
+	}
+	ends->pos[k] = pos;
+	ends->windex[k] = windex;
+	return 1;
 }
 
-/*
- * Check that 'arg_len' is equal to 'x_len', or that it's the length of an
- * argument that can be recycled to the length of 'x'.
- * Assumes that 'arg_len' and 'x_len' are >= 0.
- */
-static void check_arg_is_recyclable(int arg_len, int x_len,
-		const char *arg_label, const char *x_label)
+/* Remove the smallest end (i.e. 'ends->pos[0]'). */
+static void pop_pending_end(PendingEnds *ends)
 {
-	if (arg_len < x_len) {
-		if (arg_len == 0)
-			error("cannot recycle zero-length '%s' "
-			      "to the length of '%s'",
-			      arg_label, x_label);
-	} else if (arg_len > x_len) {
-		if (arg_len >= 2)
-			error("'%s' is longer than '%s'",
-			      arg_label, x_label);
+	int n, pos, windex, k, child;
+
+	n = --ends->nelt;
+	if (n == 0)
+		return;
+	pos = ends->pos[n];
+	windex = ends->windex[n];
+	for (k = 0; (child = 2 * k + 1) < n; k = child) {
+		if (child + 1 < n && ends->pos[child + 1] < ends->pos[child])
+			child++;
+		if (pos <= ends->pos[child])
+			break;
+		ends->pos[k] = ends->pos[child];
+		ends->windex[k] = ends->windex[child];
 	}
+	ends->pos[k] = pos;
+	ends->windex[k] = windex;
 	return;
 }
 
+/* Set '*order' to the 0-based indices of the ranges sorted by ascending
+   start (ties are kept in original order), or to NULL if the ranges are
+   already sorted. Returns 0 if memory allocation failed and 1 otherwise. */
+static int order_ranges_by_start(const CoverageJob *job, int **order)
+{
+	unsigned long long *keys, *keys2, *sorted_keys;
+	int x_len, i;
+
+	*order = NULL;
+	x_len = job->x_len;
+	for (i = 1; i < x_len; i++)
+		if (job->x_start[i] < job->x_start[i - 1])
+			break;
+	if (i >= x_len)
+		return 1;
+	keys = (unsigned long long *)
+		malloc(sizeof(unsigned long long) * (size_t) x_len);
+	keys2 = (unsigned long long *)
+		malloc(sizeof(unsigned long long) * (size_t) x_len);
+	*order = (int *) malloc(sizeof(int) * (size_t) x_len);
+	if (keys == NULL || keys2 == NULL || *order == NULL) {
+		free(keys);
+		free(keys2);
+		free(*order);
+		*order = NULL;
+		return 0;
+	}
+	for (i = 0; i < x_len; i++)
+		keys[i] = ((unsigned long long) (unsigned int) job->x_start[i]
+			   << 32) | (unsigned int) i;
+	sorted_keys = radix_sort_keys(keys, keys2, x_len);
+	for (i = 0; i < x_len; i++)
+		(*order)[i] = (int) (unsigned int)
+			      (sorted_keys[i] & 0xffffffffU);
+	free(keys);
+	free(keys2);
+	return 1;
+}
 
-/****************************************************************************
- *                  compute_coverage_from_IRanges_holder()                  *
- ****************************************************************************/
+/* Double the capacity of the runs buffers. Returns 0 if memory allocation
+   failed and 1 otherwise. */
+static int grow_coverage_runs(CoverageJob *job, int *buflength)
+{
+	CoverageRuns *out;
+	size_t new_buflength;
+	int *new_lengths, *new_int_values;
+	double *new_double_values;
+
+	out = &(job->out);
+	new_buflength = 2 * (size_t) *buflength;
+	new_lengths = (int *) realloc(out->lengths,
+				      sizeof(int) * new_buflength);
+	if (new_lengths == NULL)
+		goto on_error;
+	out->lengths = new_lengths;
+	if (job->int_weight != NULL) {
+		new_int_values = (int *) realloc(out->int_values,
+					sizeof(int) * new_buflength);
+		if (new_int_values == NULL)
+			goto on_error;
+		out->int_values = new_int_values;
+	} else {
+		new_double_values = (double *) realloc(out->double_values,
+					sizeof(double) * new_buflength);
+		if (new_double_values == NULL)
+			goto on_error;
+		out->double_values = new_double_values;
+	}
+	*buflength = (int) new_buflength;
+	return 1;
+    on_error:
+	out->status = COVERAGE_ALLOC_FAILED;
+	return 0;
+}
 
-/*
- * This is probably overly cautious. Could be that the cast from double to int
- * with (int) already does exactly this (i.e. produces an NA_INTEGER for all
- * the cases explicitely handled here) and is portable.
- */
-static int double2int(double x)
+static int append_int_run(CoverageJob *job, int *buflength,
+		int value, int length)
 {
-	if (x == R_PosInf
-	 || x == R_NegInf
-	 || ISNAN(x) /* NA or NaN */
-	 || x >= (double) INT_MAX + 1.00
-	 || x <= (double) INT_MIN)
-		return NA_INTEGER;
-	return (int) x;
+	CoverageRuns *out;
+
+	out = &(job->out);
+	if (out->nrun != 0 && out->int_values[out->nrun - 1] == value) {
+		out->lengths[out->nrun - 1] += length;
+		return 1;
+	}
+	if (out->nrun == *buflength && !grow_coverage_runs(job, buflength))
+		return 0;
+	out->int_values[out->nrun] = value;
+	out->lengths[out->nrun] = length;
+	out->nrun++;
+	return 1;
 }
 
-/*
- * Args:
- *   x_holder:   A IRanges_holder struct holding the input ranges, those
- *               ranges being those of a fictive IRanges object 'x'.
- *   shift:      A numeric (integer or double) vector parallel to 'x' (will
- *               get recycled if necessary) with no NAs.
- *   width:      A single integer. NA or >= 0.
- *   circle_len: A single integer. NA or > 0.
- * After the input ranges are shifted:
- *   - If 'width' is a non-negative integer, then the ranges are clipped with
- *     respect to the [1, width] interval and the function returns 'width'.
- *   - If 'width' is NA, then the ranges are clipped with respect to the
- *     [1, +inf) interval (i.e. they're only clipped on the left) and the
- *     function returns 'max(end(x))' or 0 if 'x' is empty.
- * The shifted and clipped ranges are returned in 'out_ranges'.
- * Let's call 'cvg_len' the value returned by the function. If the output
- * ranges are in a tiling configuration with respect to the [1, cvg_len]
- * interval (i.e. they're non-overlapping, ordered from left to right, and
- * they fully cover the interval), then '*out_ranges_are_tiles' is set to 1.
- * Otherwise, it's set to 0.
- */
-static int shift_and_clip_ranges(const IRanges_holder *x_holder,
-		SEXP shift, int width, int circle_len,
-		IntPairAE *out_ranges, int *out_ranges_are_tiles)
+static int append_double_run(CoverageJob *job, int *buflength,
+		double value, int length)
 {
-	int x_len, shift_len, cvg_len, auto_cvg_len, prev_end,
-	    i, j, x_start, x_end, shift_elt, tmp;
+	CoverageRuns *out;
 
-	x_len = _get_length_from_IRanges_holder(x_holder);
+	out = &(job->out);
+	if (out->nrun != 0 &&
+	    same_double(out->double_values[out->nrun - 1], value)) {
+		out->lengths[out->nrun - 1] += length;
+		return 1;
+	}
+	if (out->nrun == *buflength && !grow_coverage_runs(job, buflength))
+		return 0;
+	out->double_values[out->nrun] = value;
+	out->lengths[out->nrun] = length;
+	out->nrun++;
+	return 1;
+}
 
-	/* Check 'shift'. */
-	check_arg_is_numeric(shift, shift_label);
-	shift_len = LENGTH(shift);
-	check_arg_is_recyclable(shift_len, x_len, shift_label, x_label);
+/* Position of the next start or end, or 'cvg_len + 1' if there is none
+   left. */
+static int next_event_pos(const CoverageJob *job, const int *order, int n,
+		const PendingEnds *ends)
+{
+	int next_pos, pos;
 
-	/* Infer 'cvg_len' from 'width' and 'circle_len'. */
-	*out_ranges_are_tiles = 1;
-	if (width == NA_INTEGER) {
-		auto_cvg_len = 1;
-	} else if (width < 0) {
-		error("'%s' cannot be negative", width_label);
-	} else if (width == 0) {
-		return width;
-	} else if (circle_len == NA_INTEGER) {
-		auto_cvg_len = 0;
-	} else if (circle_len <= 0) {
-		error("length of underlying circular sequence is <= 0");
-	} else if (width > circle_len) {
-		error("'%s' cannot be greater than length of "
-		      "underlying circular sequence", width_label);
-	} else {
-		auto_cvg_len = 1;
+	next_pos = job->cvg_len + 1;
+	if (n < job->x_len) {
+		pos = job->x_start[order != NULL ? order[n] : n];
+		if (pos < next_pos)
+			next_pos = pos;
 	}
-	cvg_len = auto_cvg_len ? 0 : width;
-	if (x_len == 0) {
-		if (cvg_len != 0)
+	if (ends->nelt != 0 && ends->pos[0] < next_pos)
+		next_pos = ends->pos[0];
+	return next_pos;
+}
+
+static void int_coverage_blocked(CoverageJob *job)
+{
+	const int *weight;
+	int *order, *tile_buf, *ovflow, buflength, n, i, j, w,
+	    t0, t1, tile_len, pos, next_pos, k, k2, cumsum;
+	PendingEnds ends;
+
+	if (!order_ranges_by_start(job, &order)) {
+		job->out.status = COVERAGE_ALLOC_FAILED;
+		return;
+	}
+	tile_buf = (int *) malloc(sizeof(int) * COVERAGE_TILE_LEN);
+	buflength = 1024;
+	if (!init_pending_ends(&ends, 1024) || tile_buf == NULL
+	 || !alloc_coverage_runs(job, buflength))
+	{
+		job->out.status = COVERAGE_ALLOC_FAILED;
+		goto done;
+	}
+	job->out.nrun = 0;
+	weight = job->int_weight;
+	ovflow = &(job->out.ovflow);
+	cumsum = 0;
+	n = 0;  /* nb of ranges already walked */
+	t0 = 1;
+	while (t0 <= job->cvg_len) {
+		next_pos = next_event_pos(job, order, n, &ends);
+		if (next_pos > t0) {
+			/* Nothing happens on [t0, next_pos). */
+			if (!append_int_run(job, &buflength, cumsum,
+					    next_pos - t0))
+				goto done;
+			t0 = next_pos;
+			continue;
+		}
+		/* Process tile [t0, t1). */
+		tile_len = job->cvg_len - t0 + 1;
+		if (tile_len > COVERAGE_TILE_LEN)
+			tile_len = COVERAGE_TILE_LEN;
+		t1 = t0 + tile_len;
+		memset(tile_buf, 0, sizeof(int) * tile_len);
+		while (ends.nelt != 0 && ends.pos[0] < t1) {
+			k = ends.pos[0] - t0;
+			w = weight[ends.windex[0]];
+			tile_buf[k] = add_ints(tile_buf[k],
+					       w == NA_INTEGER ? w : - w, ovflow);
+			pop_pending_end(&ends);
+		}
+		for ( ; n < job->x_len; n++) {
+			i = order != NULL ? order[n] : n;
+			pos = job->x_start[i];
+			if (pos >= t1)
+				break;
+			if (user_interrupted(job, n))
+				goto done;
+			j = i % job->weight_len;
+			w = weight[j];
+			k = pos - t0;
+			tile_buf[k] = add_ints(tile_buf[k], w, ovflow);
+			pos += job->x_width[i];
+			if (pos < t1) {
+				k = pos - t0;
+				tile_buf[k] = add_ints(tile_buf[k],
+					w == NA_INTEGER ? w : - w, ovflow);
+			} else if (!push_pending_end(&ends, pos, j)) {
+				job->out.status = COVERAGE_ALLOC_FAILED;
+				goto done;
+			}
+		}
+		/* Cumulative sum. A new run can only start where the tile
+		   buffer is not 0. */
+		for (k = 0; k < tile_len; k = k2) {
+			cumsum = add_ints(tile_buf[k], cumsum, ovflow);
+			for (k2 = k + 1; k2 < tile_len && tile_buf[k2] == 0; k2++)
+				;
+			if (!append_int_run(job, &buflength, cumsum, k2 - k))
+				goto done;
+		}
+		t0 = t1;
+	}
+    done:
+	free(order);
+	free(tile_buf);
+	free_pending_ends(&ends);
+	return;
+}
+
+static void double_coverage_blocked(CoverageJob *job)
+{
+	const double *weight;
+	double *tile_buf, w, cumsum;
+	int *order, buflength, n, i, j,
+	    t0, t1, tile_len, pos, next_pos, k, k2;
+	PendingEnds ends;
+
+	if (!order_ranges_by_start(job, &order)) {
+		job->out.status = COVERAGE_ALLOC_FAILED;
+		return;
+	}
+	tile_buf = (double *) malloc(sizeof(double) * COVERAGE_TILE_LEN);
+	buflength = 1024;
+	if (!init_pending_ends(&ends, 1024) || tile_buf == NULL
+	 || !alloc_coverage_runs(job, buflength))
+	{
+		job->out.status = COVERAGE_ALLOC_FAILED;
+		goto done;
+	}
+	job->out.nrun = 0;
+	weight = job->double_weight;
+	cumsum = 0.0;
+	n = 0;  /* nb of ranges already walked */
+	t0 = 1;
+	while (t0 <= job->cvg_len) {
+		next_pos = next_event_pos(job, order, n, &ends);
+		if (next_pos > t0) {
+			/* Nothing happens on [t0, next_pos). */
+			if (!append_double_run(job, &buflength, cumsum,
+					       next_pos - t0))
+				goto done;
+			t0 = next_pos;
+			continue;
+		}
+		/* Process tile [t0, t1). */
+		tile_len = job->cvg_len - t0 + 1;
+		if (tile_len > COVERAGE_TILE_LEN)
+			tile_len = COVERAGE_TILE_LEN;
+		t1 = t0 + tile_len;
+		memset(tile_buf, 0, sizeof(double) * tile_len);
+		while (ends.nelt != 0 && ends.pos[0] < t1) {
+			tile_buf[ends.pos[0] - t0] -= weight[ends.windex[0]];
+			pop_pending_end(&ends);
+		}
+		for ( ; n < job->x_len; n++) {
+			i = order != NULL ? order[n] : n;
+			pos = job->x_start[i];
+			if (pos >= t1)
+				break;
+			if (user_interrupted(job, n))
+				goto done;
+			j = i % job->weight_len;
+			w = weight[j];
+			tile_buf[pos - t0] += w;
+			pos += job->x_width[i];
+			if (pos < t1) {
+				tile_buf[pos - t0] -= w;
+			} else if (!push_pending_end(&ends, pos, j)) {
+				job->out.status = COVERAGE_ALLOC_FAILED;
+				goto done;
+			}
+		}
+		/* Cumulative sum. A new run can only start where the tile
+		   buffer is not 0. */
+		for (k = 0; k < tile_len; k = k2) {
+			cumsum += tile_buf[k];
+			for (k2 = k + 1; k2 < tile_len && tile_buf[k2] == 0.0;
+			     k2++)
+				;
+			if (!append_double_run(job, &buflength, cumsum,
+					       k2 - k))
+				goto done;
+		}
+		t0 = t1;
+	}
+    done:
+	free(order);
+	free(tile_buf);
+	free_pending_ends(&ends);
+	return;
+}
+
+static void coverage_blocked(CoverageJob *job)
+{
+	if (job->int_weight != NULL)
+		int_coverage_blocked(job);
+	else
+		double_coverage_blocked(job);
+	return;
+}
+
+
+/****************************************************************************
+ * Running the coverage jobs.
+ */
+
+static void run_coverage_job(CoverageJob *job)
+{
+	if (job->x_len == 0) {
+		set_zero_coverage(job);
+		return;
+	}
+	if (job->method == 1)
+		coverage_sort(job);
+	else if (job->method == 2)
+		coverage_hash(job);
+	else
+		coverage_blocked(job);
+	return;
+}
+
+/* Run the jobs concurrently if 'nthreads' is > 1 and OpenMP is available.
+   Only the jobs run on the main thread can be interrupted by the user. */
+static void run_coverage_jobs(CoverageJob *jobs, int njob, int nthreads)
+{
+	int k;
+
+#ifdef _OPENMP
+	if (nthreads > 1 && njob > 1) {
+		#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1)
+		for (k = 0; k < njob; k++)
+			run_coverage_job(jobs + k);
+		return;
+	}
+#endif
+	for (k = 0; k < njob; k++) {
+		jobs[k].check_interrupt = 1;
+		run_coverage_job(jobs + k);
+		if (jobs[k].out.status != COVERAGE_OK)
+			break;
+	}
+	return;
+}
+
+/* Must be called on the main thread once all the jobs are done. Raises an
+   error (after releasing the memory used by all the jobs) if one of them
+   failed. */
+static void check_coverage_jobs(CoverageJob *jobs, int njob)
+{
+	int k, status;
+
+	status = COVERAGE_OK;
+	for (k = 0; k < njob; k++)
+		if (jobs[k].out.status != COVERAGE_OK)
+			status = jobs[k].out.status;
+	if (status == COVERAGE_OK)
+		return;
+	for (k = 0; k < njob; k++)
+		free_coverage_runs(&(jobs[k].out));
+	if (status == COVERAGE_INTERRUPTED)
+		error("coverage computation interrupted by the user");
+	error("coverage computation: memory allocation failed");
+}
+
+/* Must be called on the main thread. Releases the memory used by the job. */
+static SEXP new_Rle_from_coverage_job(CoverageJob *job)
+{
+	CoverageRuns *out;
+	SEXP ans;
+
+	out = &(job->out);
+	if (out->ovflow)
+		warning("NAs produced by integer overflow");
+	PROTECT(ans = job->int_weight != NULL ?
+		construct_integer_Rle(out->int_values, out->nrun,
+				      out->lengths, 0) :
+		construct_numeric_Rle(out->double_values, out->nrun,
+				      out->lengths, 0));
+	free_coverage_runs(out);
+	UNPROTECT(1);
+	return ans;
+}
+
+/****************************************************************************
+ * Cost model used by method="auto".
+ *
+ * The running time of each method (in nanoseconds) is estimated from the
+ * number of ranges, the length of the coverage vector, the total width of
+ * the ranges, and the type of the weights. The constants are rough
+ * per-operation timings observed on a typical x86-64 machine. They are
+ * multiplied by per-method scaling factors that can be calibrated on the
+ * current machine with calibrateCoverageMethods().
+ */
+
+/* Above this size (in bytes), the random writes of the "hash" method in
+   its dense buffer start to miss the cache. */
+#define	COVERAGE_CACHE_SIZE (4 * 1024 * 1024)
+
+static double cost_scales[3] = {1.0, 1.0, 1.0};  /* sort, hash, blocked */
+
+typedef struct coverage_costs_t {
+	double sort, hash, blocked;
+} CoverageCosts;
+
+/* Number of non-trivial passes of radix_sort_keys() on positions that are
+   <= 'cvg_len' + 1. */
+static int nb_radix_passes(int cvg_len)
+{
+	unsigned int max_pos;
+	int npass;
+
+	max_pos = (unsigned int) cvg_len + 1U;
+	for (npass = 1; max_pos > 0xffU; npass++)
+		max_pos >>= 8;
+	return npass;
+}
+
+static CoverageCosts estimate_coverage_costs(int x_len, int cvg_len,
+		double total_width, int elt_size, int sorted_by_start)
+{
+	CoverageCosts costs;
+	double nkey, npass, write_cost, pos_cost, ncrossing, nvisited;
+
+	/* "sort": radix sort of the 2 * x_len SEids then 1 walk on them. */
+	nkey = 2.0 * x_len;
+	npass = (double) nb_radix_passes(cvg_len);
+	costs.sort = nkey * (1.0 * npass + 3.0);
+
+	/* "hash": 2 random writes per range in a dense buffer of length
+	   'cvg_len', then 1 walk on the buffer (the cumulative sum and the
+	   extraction of the runs are done block by block). */
+	if ((double) cvg_len * elt_size <= COVERAGE_CACHE_SIZE) {
+		write_cost = 2.0;
+		pos_cost = elt_size == sizeof(int) ? 0.3 : 0.6;
+	} else {
+		write_cost = 15.0;
+		pos_cost = elt_size == sizeof(int) ? 0.5 : 1.0;
+	}
+	costs.hash = nkey * write_cost + (double) cvg_len * pos_cost;
+
+	/* "blocked": the ranges are ordered by start (unless they already
+	   are), the ends that cross a tile boundary go thru the min-heap, and
+	   the tiles are walked (the stretches with no start or end are
+	   skipped). */
+	ncrossing = total_width / COVERAGE_TILE_LEN;
+	if (ncrossing > x_len)
+		ncrossing = x_len;
+	nvisited = nkey * COVERAGE_TILE_LEN;
+	if (nvisited > cvg_len)
+		nvisited = cvg_len;
+	costs.blocked = nkey * 2.0 +
+			ncrossing * (2.0 + log2(ncrossing + 1.0)) +
+			nvisited * (elt_size == sizeof(int) ? 0.8 : 1.0);
+	if (!sorted_by_start)
+		costs.blocked += x_len * (1.0 * npass + 2.0);
+
+	costs.sort *= cost_scales[0];
+	costs.hash *= cost_scales[1];
+	costs.blocked *= cost_scales[2];
+	return costs;
+}
+
+/* Returns 1 for "sort", 2 for "hash", and 3 for "blocked". */
+static int cheapest_coverage_method(const CoverageCosts *costs)
+{
+	int method;
+	double min_cost;
+
+	method = 1;
+	min_cost = costs->sort;
+	if (costs->hash < min_cost) {
+		method = 2;
+		min_cost = costs->hash;
+	}
+	if (costs->blocked < min_cost)
+		method = 3;
+	return method;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   scales: A numeric vector of length 3 (the scaling factors for the
+ *           "sort", "hash", and "blocked" methods), or NULL.
+ * Sets the scaling factors of the cost model (unless 'scales' is NULL) and
+ * returns the previous ones.
+ */
+SEXP coverage_set_cost_scales(SEXP scales)
+{
+	SEXP ans;
+	int i;
+
+	PROTECT(ans = NEW_NUMERIC(3));
+	memcpy(REAL(ans), cost_scales, sizeof(cost_scales));
+	if (scales != R_NilValue) {
+		if (!IS_NUMERIC(scales) || LENGTH(scales) != 3)
+			error("'scales' must be a numeric vector of length 3");
+		for (i = 0; i < 3; i++)
+			if (!R_FINITE(REAL(scales)[i]) || REAL(scales)[i] <= 0)
+				error("'scales' must contain positive numbers");
+		memcpy(cost_scales, REAL(scales), sizeof(cost_scales));
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+
+/****************************************************************************
+ * Helper functions for checking args of type SEXP.                         *
+ * They either pass (and return nothing) or raise an error with an          *
+ * informative message.                                                     *
+ ****************************************************************************/
+
+static void check_arg_is_integer(SEXP arg, const char *arg_label)
+{
+	if (!IS_INTEGER(arg))
+		error("'%s' must be an integer vector", arg_label);
+	return;
+}
+
+static void check_arg_is_numeric(SEXP arg, const char *arg_label)
+{
+	if (!(IS_INTEGER(arg) || IS_NUMERIC(arg)))
+		error("'%s' must be an integer or numeric vector", arg_label);
+	return;
+}
+
+static void check_arg_is_list(SEXP arg, const char *arg_label)
+{
+	if (!IS_LIST(arg))
+		error("'%s' must be a list", arg_label);
+	return;
+}
+
+/*
+ * Check that 'arg_len' is equal to 'x_len', or that it's the length of an
+ * argument that can be recycled to the length of 'x'.
+ * Assumes that 'arg_len' and 'x_len' are >= 0.
+ */
+static void check_arg_is_recyclable(int arg_len, int x_len,
+		const char *arg_label, const char *x_label)
+{
+	if (arg_len < x_len) {
+		if (arg_len == 0)
+			error("cannot recycle zero-length '%s' "
+			      "to the length of '%s'",
+			      arg_label, x_label);
+	} else if (arg_len > x_len) {
+		if (arg_len >= 2)
+			error("'%s' is longer than '%s'",
+			      arg_label, x_label);
+	}
+	return;
+}
+
+
+/****************************************************************************
+ *                  compute_coverage_from_IRanges_holder()                  *
+ ****************************************************************************/
+
+/*
+ * This is probably overly cautious. Could be that the cast from double to int
+ * with (int) already does exactly this (i.e. produces an NA_INTEGER for all
+ * the cases explicitely handled here) and is portable.
+ */
+static int double2int(double x)
+{
+	if (x == R_PosInf
+	 || x == R_NegInf
+	 || ISNAN(x) /* NA or NaN */
+	 || x >= (double) INT_MAX + 1.00
+	 || x <= (double) INT_MIN)
+		return NA_INTEGER;
+	return (int) x;
+}
+
+/*
+ * Args:
+ *   x_holder:   A IRanges_holder struct holding the input ranges, those
+ *               ranges being those of a fictive IRanges object 'x'.
+ *   shift:      A numeric (integer or double) vector parallel to 'x' (will
+ *               get recycled if necessary) with no NAs.
+ *   width:      A single integer. NA or >= 0.
+ *   circle_len: A single integer. NA or > 0.
+ * After the input ranges are shifted:
+ *   - If 'width' is a non-negative integer, then the ranges are clipped with
+ *     respect to the [1, width] interval and the function returns 'width'.
+ *   - If 'width' is NA, then the ranges are clipped with respect to the
+ *     [1, +inf) interval (i.e. they're only clipped on the left) and the
+ *     function returns 'max(end(x))' or 0 if 'x' is empty.
+ * The shifted and clipped ranges are returned in 'out_ranges'.
+ * Let's call 'cvg_len' the value returned by the function. If the output
+ * ranges are in a tiling configuration with respect to the [1, cvg_len]
+ * interval (i.e. they're non-overlapping, ordered from left to right, and
+ * they fully cover the interval), then '*out_ranges_are_tiles' is set to 1.
+ * Otherwise, it's set to 0.
+ */
+static int shift_and_clip_ranges(const IRanges_holder *x_holder,
+		SEXP shift, int width, int circle_len,
+		IntPairAE *out_ranges, int *out_ranges_are_tiles)
+{
+	int x_len, shift_len, cvg_len, auto_cvg_len, prev_end,
+	    i, j, x_start, x_end, shift_elt, tmp;
+
+	x_len = _get_length_from_IRanges_holder(x_holder);
+
+	/* Check 'shift'. */
+	check_arg_is_numeric(shift, shift_label);
+	shift_len = LENGTH(shift);
+	check_arg_is_recyclable(shift_len, x_len, shift_label, x_label);
+
+	/* Infer 'cvg_len' from 'width' and 'circle_len'. */
+	*out_ranges_are_tiles = 1;
+	if (circle_len != NA_INTEGER && circle_len <= 0)
+		error("length of underlying circular sequence is <= 0");
+	if (width == NA_INTEGER) {
+		auto_cvg_len = 1;
+	} else if (width < 0) {
+		error("'%s' cannot be negative", width_label);
+	} else if (width == 0) {
+		return width;
+	} else if (circle_len == NA_INTEGER) {
+		auto_cvg_len = 0;
+	} else if (width > circle_len) {
+		error("'%s' cannot be greater than length of "
+		      "underlying circular sequence", width_label);
+	} else {
+		auto_cvg_len = 1;
+	}
+	cvg_len = auto_cvg_len ? 0 : width;
+	if (x_len == 0) {
+		if (cvg_len != 0)
 			*out_ranges_are_tiles = 0;
 		return cvg_len;
 	}
@@ -500,11 +1515,135 @@ static int shift_and_clip_ranges(const IRanges_holder *x_holder,
 				    x_start, x_end - x_start + 1);
 	}
 	check_recycling_was_round(j, shift_len, shift_label, x_label);
-	if (*out_ranges_are_tiles && x_end != cvg_len)
+	/* 'prev_end' is the end of the last range if the ranges are tiles. */
+	if (*out_ranges_are_tiles && prev_end != cvg_len)
 		*out_ranges_are_tiles = 0;
 	return cvg_len;
 }
 
+static int append_folded_range(IntPairAE *ranges_buf, int start, int width,
+		int cvg_len)
+{
+	int end;
+
+	end = start + width - 1;
+	if (end > cvg_len)
+		end = cvg_len;
+	if (end < start)
+		return 0;
+	IntPairAE_insert_at(ranges_buf, IntPairAE_get_nelt(ranges_buf),
+			    start, end - start + 1);
+	return 1;
+}
+
+/*
+ * Folds the ranges in 'ranges_buf' onto the [1, circle_len] interval and
+ * clips them with respect to [1, cvg_len]. The ranges must have been
+ * shifted to the first circle by shift_and_clip_ranges() (i.e. their
+ * starts are in [1, circle_len]). A range that wraps around the circle is
+ * replaced by a range covering the whole circle with its weight multiplied
+ * by the number of complete turns, plus 1 or 2 ranges for the rest. The
+ * folded ranges replace the original ones in 'ranges_buf' and their
+ * weights (not recycled) are returned in '*folded_int_weight' or
+ * '*folded_double_weight' (allocated with R_alloc()).
+ * Returns the number of folded ranges.
+ */
+static int fold_ranges(IntPairAE *ranges_buf, SEXP weight,
+		int circle_len, int cvg_len,
+		int **folded_int_weight, double **folded_double_weight,
+		int *ovflow)
+{
+	int x_len, weight_len, *x_start, *x_width, nturn, rem, end,
+	    n, i, j, k, int_w;
+	double double_w;
+	long long int z;
+
+	x_len = IntPairAE_get_nelt(ranges_buf);
+	x_start = (int *) R_alloc((long) x_len + 1, sizeof(int));
+	x_width = (int *) R_alloc((long) x_len + 1, sizeof(int));
+	memcpy(x_start, ranges_buf->a->elts, sizeof(int) * x_len);
+	memcpy(x_width, ranges_buf->b->elts, sizeof(int) * x_len);
+	/* Each range produces at most 3 folded ranges. */
+	if (IS_INTEGER(weight))
+		*folded_int_weight = (int *)
+			R_alloc(3 * (long) x_len + 1, sizeof(int));
+	else
+		*folded_double_weight = (double *)
+			R_alloc(3 * (long) x_len + 1, sizeof(double));
+	weight_len = LENGTH(weight);
+	IntPairAE_set_nelt(ranges_buf, 0);
+	/* Only one of them is set in the loop below, depending on the type
+	   of 'weight'. */
+	int_w = 0;
+	double_w = 0.0;
+	for (i = j = n = 0; i < x_len; i++, j++) {
+		if (j >= weight_len)
+			j = 0; /* recycle j */
+		nturn = x_width[i] / circle_len;
+		rem = x_width[i] % circle_len;
+		if (IS_INTEGER(weight)) {
+			int_w = INTEGER(weight)[j];
+			if (nturn != 0
+			 && append_folded_range(ranges_buf, 1, circle_len,
+						cvg_len))
+			{
+				z = (long long int) nturn * int_w;
+				if (int_w == NA_INTEGER) {
+					z = NA_INTEGER;
+				} else if (z > INT_MAX || z <= INT_MIN) {
+					*ovflow = 1;
+					z = NA_INTEGER;
+				}
+				(*folded_int_weight)[n++] = (int) z;
+			}
+		} else {
+			double_w = REAL(weight)[j];
+			if (nturn != 0
+			 && append_folded_range(ranges_buf, 1, circle_len,
+						cvg_len))
+				(*folded_double_weight)[n++] = nturn * double_w;
+		}
+		if (rem == 0)
+			continue;
+		end = x_start[i] + rem - 1;
+		if (end <= circle_len) {
+			k = append_folded_range(ranges_buf, x_start[i], rem,
+						cvg_len);
+		} else {
+			k = append_folded_range(ranges_buf, x_start[i],
+					circle_len - x_start[i] + 1, cvg_len);
+			k += append_folded_range(ranges_buf, 1,
+					end - circle_len, cvg_len);
+		}
+		for ( ; k > 0; k--, n++) {
+			if (IS_INTEGER(weight))
+				(*folded_int_weight)[n] = int_w;
+			else
+				(*folded_double_weight)[n] = double_w;
+		}
+	}
+	return n;
+}
+
+/* Cost of each method on the shifted and clipped ranges. */
+static CoverageCosts get_coverage_costs(const int *x_start,
+		const int *x_width, int x_len, int cvg_len, SEXP weight)
+{
+	double total_width;
+	int sorted_by_start, i;
+
+	total_width = 0.0;
+	sorted_by_start = 1;
+	for (i = 0; i < x_len; i++) {
+		total_width += x_width[i];
+		if (i != 0 && x_start[i] < x_start[i - 1])
+			sorted_by_start = 0;
+	}
+	return estimate_coverage_costs(x_len, cvg_len, total_width,
+			IS_INTEGER(weight) ? sizeof(int) : sizeof(double),
+			sorted_by_start);
+}
+
 /*
  * Args:
  *   x_holder:   A IRanges_holder struct holding the input ranges, those
@@ -515,29 +1654,51 @@ static int shift_and_clip_ranges(const IRanges_holder *x_holder,
  *   weight:     A numeric (integer or double) vector parallel to 'x' (will
  *               get recycled if necessary).
  *   circle_len: A single integer. NA or > 0.
- *   method:     Either "auto", "sort", or "hash".
- * Returns an Rle object.
+ *   method:     Either "auto", "sort", "hash", or "blocked".
+ *   ranges_buf: The buffer where to store the shifted and clipped ranges.
+ *               It must not be reused before the job is run.
+ * Returns an Rle object if the coverage can be computed right away (short
+ * path for the tiling case). Otherwise returns R_NilValue and prepares 'job'.
  */
-static SEXP compute_coverage_from_IRanges_holder(
+static SEXP prepare_coverage_job(
 		const IRanges_holder *x_holder,
 		SEXP shift, int width, SEXP weight, int circle_len,
-		SEXP method, IntPairAE *ranges_buf)
+		SEXP method, IntPairAE *ranges_buf, CoverageJob *job)
 {
 	int x_len, cvg_len, out_ranges_are_tiles, weight_len,
-	    effective_method, take_short_path;
+	    effective_method, take_short_path, *folded_int_weight, ovflow;
 	const int *x_start, *x_width;
+	double *folded_double_weight;
 	const char *method0;
+	CoverageCosts costs;
 
 	x_len = _get_length_from_IRanges_holder(x_holder);
 	cvg_len = shift_and_clip_ranges(x_holder, shift, width, circle_len,
 					ranges_buf, &out_ranges_are_tiles);
-	x_start = ranges_buf->a->elts;
-	x_width = ranges_buf->b->elts;
 
 	/* Check 'weight'. */
 	check_arg_is_numeric(weight, weight_label);
 	weight_len = LENGTH(weight);
 	check_arg_is_recyclable(weight_len, x_len, weight_label, x_label);
+	if (x_len != 0)
+		check_recycling_was_round((x_len - 1) % weight_len + 1,
+					  weight_len, weight_label, x_label);
+
+	/* Fold the ranges onto the circular sequence. The folded ranges come
+	   with their own (non-recycled) weights. */
+	folded_int_weight = NULL;
+	folded_double_weight = NULL;
+	ovflow = 0;
+	if (circle_len != NA_INTEGER && width != 0) {
+		cvg_len = width == NA_INTEGER ? circle_len : width;
+		x_len = fold_ranges(ranges_buf, weight, circle_len, cvg_len,
+				    &folded_int_weight, &folded_double_weight,
+				    &ovflow);
+		weight_len = x_len;
+		out_ranges_are_tiles = 0;
+	}
+	x_start = ranges_buf->a->elts;
+	x_width = ranges_buf->b->elts;
 
 	/* Infer 'effective_method' from 'method' and 'cvg_len'. */
 	if (!IS_CHARACTER(method) || LENGTH(method) != 1)
@@ -547,14 +1708,18 @@ static SEXP compute_coverage_from_IRanges_holder(
 		error("'method' cannot be NA");
 	method0 = CHAR(method);
 	if (strcmp(method0, "auto") == 0) {
-		/* Based on empirical observation. */
-		effective_method = x_len <= 0.25 * cvg_len ? 1 : 2;
+		costs = get_coverage_costs(x_start, x_width, x_len, cvg_len,
+					   weight);
+		effective_method = cheapest_coverage_method(&costs);
 	} else if (strcmp(method0, "sort") == 0) {
 		effective_method = 1;
 	} else if (strcmp(method0, "hash") == 0) {
 		effective_method = 2;
+	} else if (strcmp(method0, "blocked") == 0) {
+		effective_method = 3;
 	} else {
-		error("'method' must be \"auto\", \"sort\", or \"hash\"");
+		error("'method' must be \"auto\", \"sort\", \"hash\", "
+		      "or \"blocked\"");
 	}
 
 	//Rprintf("out_ranges_are_tiles = %d\n", out_ranges_are_tiles);
@@ -585,25 +1750,41 @@ static SEXP compute_coverage_from_IRanges_holder(
 		}
 	}
 	//Rprintf("taking normal path\n");
-	return effective_method == 1 ?
-	       coverage_sort(x_start, x_width, x_len, weight, cvg_len) :
-	       coverage_hash(x_start, x_width, x_len, weight, cvg_len);
+	memset(job, 0, sizeof(CoverageJob));
+	job->x_start = x_start;
+	job->x_width = x_width;
+	job->x_len = x_len;
+	if (folded_int_weight != NULL)
+		job->int_weight = folded_int_weight;
+	else if (folded_double_weight != NULL)
+		job->double_weight = folded_double_weight;
+	else if (IS_INTEGER(weight))
+		job->int_weight = INTEGER(weight);
+	else
+		job->double_weight = REAL(weight);
+	job->weight_len = weight_len;
+	job->cvg_len = cvg_len;
+	job->method = effective_method;
+	job->out.ovflow = ovflow;
+	return R_NilValue;
 }
 
-/* --- .Call ENTRY POINT ---
- * Args:
- *   x:          An IRanges object.
- *   shift:      A numeric (integer or double) vector parallel to 'x' (will
- *               get recycled if necessary) with no NAs.
- *   width:      A single integer. NA or >= 0.
- *   weight:     A numeric (integer or double) vector parallel to 'x' (will
- *               get recycled if necessary).
- *   circle_len: A single integer. NA or > 0.
- *   method:     Either "auto", "sort", or "hash".
- * Returns an Rle object.
- */
-SEXP IRanges_coverage(SEXP x, SEXP shift, SEXP width, SEXP weight,
-		SEXP circle_len, SEXP method)
+int _get_nthreads(SEXP nthreads)
+{
+	int nthreads0;
+
+	if (!IS_INTEGER(nthreads) || LENGTH(nthreads) != 1)
+		error("'nthreads' must be a single integer");
+	nthreads0 = INTEGER(nthreads)[0];
+	if (nthreads0 == NA_INTEGER || nthreads0 < 1)
+		error("'nthreads' must be a single positive integer");
+	return nthreads0;
+}
+
+/* Same as prepare_coverage_job() but takes the arguments of
+   IRanges_coverage(). */
+static SEXP prepare_IRanges_coverage_job(SEXP x, SEXP shift, SEXP width,
+		SEXP weight, SEXP circle_len, SEXP method, CoverageJob *job)
 {
 	IRanges_holder x_holder;
 	int x_len;
@@ -627,10 +1808,72 @@ SEXP IRanges_coverage(SEXP x, SEXP shift, SEXP width, SEXP weight,
 	shift_label = "shift";
 	width_label = "width";
 	weight_label = "weight";
-	return compute_coverage_from_IRanges_holder(&x_holder,
+	return prepare_coverage_job(&x_holder,
 				shift, INTEGER(width)[0],
 				weight, INTEGER(circle_len)[0],
-				method, ranges_buf);
+				method, ranges_buf, job);
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   x:          An IRanges object.
+ *   shift:      A numeric (integer or double) vector parallel to 'x' (will
+ *               get recycled if necessary) with no NAs.
+ *   width:      A single integer. NA or >= 0.
+ *   weight:     A numeric (integer or double) vector parallel to 'x' (will
+ *               get recycled if necessary).
+ *   circle_len: A single integer. NA or > 0.
+ *   method:     Either "auto", "sort", "hash", or "blocked".
+ * Returns an Rle object.
+ */
+SEXP IRanges_coverage(SEXP x, SEXP shift, SEXP width, SEXP weight,
+		SEXP circle_len, SEXP method)
+{
+	CoverageJob job;
+	SEXP ans;
+
+	ans = prepare_IRanges_coverage_job(x, shift, width, weight,
+					   circle_len, method, &job);
+	if (ans != R_NilValue)
+		return ans;
+	run_coverage_jobs(&job, 1, 1);
+	check_coverage_jobs(&job, 1);
+	return new_Rle_from_coverage_job(&job);
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args: same as IRanges_coverage() minus 'method'.
+ * Returns the costs estimated by the cost model for the "sort", "hash",
+ * and "blocked" methods, in a named numeric vector, or NULL if the ranges
+ * form a tiling (in which case the coverage is computed without using any
+ * of these methods).
+ */
+SEXP IRanges_coverage_costs(SEXP x, SEXP shift, SEXP width, SEXP weight,
+		SEXP circle_len)
+{
+	CoverageJob job;
+	CoverageCosts costs;
+	SEXP method, ans, ans_names;
+
+	PROTECT(method = mkString("sort"));
+	ans = prepare_IRanges_coverage_job(x, shift, width, weight,
+					   circle_len, method, &job);
+	UNPROTECT(1);
+	if (ans != R_NilValue)
+		return R_NilValue;
+	costs = get_coverage_costs(job.x_start, job.x_width, job.x_len,
+				   job.cvg_len, weight);
+	PROTECT(ans = NEW_NUMERIC(3));
+	REAL(ans)[0] = costs.sort;
+	REAL(ans)[1] = costs.hash;
+	REAL(ans)[2] = costs.blocked;
+	PROTECT(ans_names = NEW_CHARACTER(3));
+	SET_STRING_ELT(ans_names, 0, mkChar("sort"));
+	SET_STRING_ELT(ans_names, 1, mkChar("hash"));
+	SET_STRING_ELT(ans_names, 2, mkChar("blocked"));
+	SET_NAMES(ans, ans_names);
+	UNPROTECT(2);
+	return ans;
 }
 
 /* --- .Call ENTRY POINT ---
@@ -649,17 +1892,21 @@ SEXP IRanges_coverage(SEXP x, SEXP shift, SEXP width, SEXP weight,
  *                recycled if necessary.
  *   circle_lens: An integer vector of length N (will get recycled if
  *                necessary). Values must be NAs or > 0.
- *   method:      Either "auto", "sort", or "hash".
+ *   method:      Either "auto", "sort", "hash", or "blocked".
+ *   nthreads:    A single positive integer. The number of threads to use to
+ *                compute the coverage of the list elements concurrently.
+ *                Ignored if IRanges was compiled without OpenMP support.
  * Returns a list of N RleList objects.
  */
 SEXP CompressedIRangesList_coverage(SEXP x,
 		SEXP shift, SEXP width, SEXP weight, SEXP circle_lens,
-		SEXP method)
+		SEXP method, SEXP nthreads)
 {
 	CompressedIRangesList_holder x_holder;
 	int x_len, shift_len, width_len, weight_len, circle_lens_len,
-	    i, j, k, l, m;
+	    nthreads0, i, j, k, l, m, njob, *job_idx;
 	IntPairAE *ranges_buf;
+	CoverageJob *jobs;
 	SEXP ans, ans_elt, shift_elt, weight_elt;
 	IRanges_holder x_elt_holder;
 	char x_label_buf[40], shift_label_buf[40],
@@ -688,12 +1935,18 @@ SEXP CompressedIRangesList_coverage(SEXP x,
 	circle_lens_len = LENGTH(circle_lens);
 	check_arg_is_recyclable(circle_lens_len, x_len, "circle.length", "x");
 
-	ranges_buf = new_IntPairAE(0, 0);
+	nthreads0 = _get_nthreads(nthreads);
+
 	x_label = x_label_buf;
 	shift_label = shift_label_buf;
 	width_label = width_label_buf;
 	weight_label = weight_label_buf;
+	jobs = (CoverageJob *) R_alloc((long) x_len, sizeof(CoverageJob));
+	job_idx = (int *) R_alloc((long) x_len, sizeof(int));
+	njob = 0;
 	PROTECT(ans = NEW_LIST(x_len));
+	/* 1st pass: prepare the jobs on the main thread. Each job needs its
+	   own ranges buffer. */
 	for (i = j = k = l = m = 0; i < x_len; i++, j++, k++, l++, m++) {
 		if (j >= shift_len)
 			j = 0; /* recycle j */
@@ -715,21 +1968,1216 @@ SEXP CompressedIRangesList_coverage(SEXP x,
 						&x_holder, i);
 		shift_elt = VECTOR_ELT(shift, j);
 		weight_elt = VECTOR_ELT(weight, l);
-		PROTECT(ans_elt = compute_coverage_from_IRanges_holder(
+		ranges_buf = new_IntPairAE(0, 0);
+		PROTECT(ans_elt = prepare_coverage_job(
 						&x_elt_holder,
 						shift_elt,
 						INTEGER(width)[k],
 						weight_elt,
 						INTEGER(circle_lens)[m],
-						method, ranges_buf));
-		SET_VECTOR_ELT(ans, i, ans_elt);
+						method, ranges_buf,
+						jobs + njob));
+		if (ans_elt != R_NilValue)
+			SET_VECTOR_ELT(ans, i, ans_elt);
+		else
+			job_idx[njob++] = i;
 		UNPROTECT(1);
 	}
 	check_recycling_was_round(j, shift_len, "shift", "x");
 	check_recycling_was_round(k, width_len, "width", "x");
 	check_recycling_was_round(l, weight_len, "weight", "x");
 	check_recycling_was_round(m, circle_lens_len, "circle.length", "x");
+
+	/* 2nd pass: run the jobs (concurrently if 'nthreads0' > 1). */
+	run_coverage_jobs(jobs, njob, nthreads0);
+	check_coverage_jobs(jobs, njob);
+
+	/* 3rd pass: turn the results into Rle objects on the main thread. */
+	for (k = 0; k < njob; k++) {
+		PROTECT(ans_elt = new_Rle_from_coverage_job(jobs + k));
+		SET_VECTOR_ELT(ans, job_idx[k], ans_elt);
+		UNPROTECT(1);
+	}
 	UNPROTECT(1);
 	return ans;
 }
 
+
+/****************************************************************************
+ *                           Coverage accumulator                           *
+ ****************************************************************************/
+
+/*
+ * A coverage accumulator stores the coverage of the ranges added to it so
+ * far as a buffer of events. An event is a position and a delta: the start
+ * of a range with the weight of the range, or its end + 1 with minus the
+ * weight. The buffer is compacted (i.e. the events are sorted by position
+ * and the events at the same position are merged) when its size has
+ * doubled since the last compaction, so it stays proportional to the
+ * number of distinct start and end positions, not to the number of ranges
+ * added. Integer weights are accumulated as long long ints so the deltas
+ * cannot overflow. The first batch of ranges with numeric weights switches
+ * the accumulator to doubles.
+ */
+
+#define	ACC_MIN_BUFLENGTH 4096
+
+typedef struct coverage_acc_t {
+	int cvg_len;  /* NA_INTEGER if inferred from the ranges */
+	int max_end;  /* largest end of the (clipped) ranges added so far */
+	int is_double;
+	int buflength;
+	int nelt;
+	int compacted_nelt;  /* nb of events after the last compaction */
+	int *pos;
+	long long int *int_delta;
+	double *double_delta;
+} CoverageAcc;
+
+static CoverageAcc *get_CoverageAcc(SEXP acc_xp)
+{
+	CoverageAcc *acc;
+
+	acc = (CoverageAcc *) R_ExternalPtrAddr(acc_xp);
+	if (acc == NULL)
+		error("pointer to CoverageAcc struct is NULL");
+	return acc;
+}
+
+static void realloc_CoverageAcc(CoverageAcc *acc, int new_buflength)
+{
+	int *new_pos;
+	long long int *new_int_delta;
+	double *new_double_delta;
+
+	new_pos = (int *) realloc(acc->pos,
+				  sizeof(int) * (size_t) new_buflength);
+	if (new_pos == NULL)
+		error("CoverageAcc: memory allocation failed");
+	acc->pos = new_pos;
+	if (acc->is_double) {
+		new_double_delta = (double *) realloc(acc->double_delta,
+				sizeof(double) * (size_t) new_buflength);
+		if (new_double_delta == NULL)
+			error("CoverageAcc: memory allocation failed");
+		acc->double_delta = new_double_delta;
+	} else {
+		new_int_delta = (long long int *) realloc(acc->int_delta,
+				sizeof(long long int) * (size_t) new_buflength);
+		if (new_int_delta == NULL)
+			error("CoverageAcc: memory allocation failed");
+		acc->int_delta = new_int_delta;
+	}
+	acc->buflength = new_buflength;
+	return;
+}
+
+static void switch_CoverageAcc_to_double(CoverageAcc *acc)
+{
+	int i;
+
+	acc->is_double = 1;
+	if (acc->buflength == 0)
+		return;
+	acc->double_delta = (double *)
+		malloc(sizeof(double) * (size_t) acc->buflength);
+	if (acc->double_delta == NULL) {
+		acc->is_double = 0;
+		error("CoverageAcc: memory allocation failed");
+	}
+	for (i = 0; i < acc->nelt; i++)
+		acc->double_delta[i] = (double) acc->int_delta[i];
+	free(acc->int_delta);
+	acc->int_delta = NULL;
+	return;
+}
+
+static void compact_CoverageAcc(CoverageAcc *acc)
+{
+	unsigned long long *keys, *keys2, *sorted_keys;
+	int *new_pos, nelt, i, k, n, pos;
+	long long int *new_int_delta, int_delta;
+	double *new_double_delta, double_delta;
+
+	nelt = acc->nelt;
+	if (nelt == acc->compacted_nelt)
+		return;
+	keys = (unsigned long long *)
+		malloc(sizeof(unsigned long long) * (size_t) nelt);
+	keys2 = (unsigned long long *)
+		malloc(sizeof(unsigned long long) * (size_t) nelt);
+	new_pos = (int *) malloc(sizeof(int) * (size_t) acc->buflength);
+	new_int_delta = NULL;
+	new_double_delta = NULL;
+	if (acc->is_double)
+		new_double_delta = (double *)
+			malloc(sizeof(double) * (size_t) acc->buflength);
+	else
+		new_int_delta = (long long int *)
+			malloc(sizeof(long long int) * (size_t) acc->buflength);
+	if (keys == NULL || keys2 == NULL || new_pos == NULL
+	 || (new_int_delta == NULL && new_double_delta == NULL))
+	{
+		free(keys);
+		free(keys2);
+		free(new_pos);
+		free(new_int_delta);
+		free(new_double_delta);
+		error("CoverageAcc: memory allocation failed");
+	}
+	for (i = 0; i < nelt; i++)
+		keys[i] = ((unsigned long long) (unsigned int) acc->pos[i]
+			   << 32) | (unsigned int) i;
+	sorted_keys = radix_sort_keys(keys, keys2, nelt);
+	/* Merge the events at the same position and drop those with a null
+	   delta. */
+	for (n = k = 0; k < nelt; ) {
+		pos = (int) (sorted_keys[k] >> 32);
+		int_delta = 0;
+		double_delta = 0.0;
+		do {
+			i = (int) (unsigned int) (sorted_keys[k] & 0xffffffffU);
+			if (acc->is_double)
+				double_delta += acc->double_delta[i];
+			else
+				int_delta += acc->int_delta[i];
+			k++;
+		} while (k < nelt && (int) (sorted_keys[k] >> 32) == pos);
+		if (acc->is_double) {
+			if (double_delta == 0.0)
+				continue;
+			new_double_delta[n] = double_delta;
+		} else {
+			if (int_delta == 0)
+				continue;
+			new_int_delta[n] = int_delta;
+		}
+		new_pos[n++] = pos;
+	}
+	free(keys);
+	free(keys2);
+	free(acc->pos);
+	free(acc->int_delta);
+	free(acc->double_delta);
+	acc->pos = new_pos;
+	acc->int_delta = new_int_delta;
+	acc->double_delta = new_double_delta;
+	acc->nelt = acc->compacted_nelt = n;
+	return;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   width: A single integer. NA or >= 0. The length of the coverage vector
+ *          (NA to infer it from the ranges).
+ */
+SEXP CoverageAcc_new(SEXP width)
+{
+	CoverageAcc *acc;
+
+	check_arg_is_integer(width, "width");
+	if (LENGTH(width) != 1)
+		error("'%s' must be a single integer", "width");
+	acc = (CoverageAcc *) calloc(1, sizeof(CoverageAcc));
+	if (acc == NULL)
+		error("CoverageAcc_new: memory allocation failed");
+	acc->cvg_len = INTEGER(width)[0];
+	return R_MakeExternalPtr(acc, R_NilValue, R_NilValue);
+}
+
+/* --- .Call ENTRY POINT --- */
+SEXP CoverageAcc_free(SEXP acc_xp)
+{
+	CoverageAcc *acc;
+
+	acc = get_CoverageAcc(acc_xp);
+	free(acc->pos);
+	free(acc->int_delta);
+	free(acc->double_delta);
+	free(acc);
+	R_SetExternalPtrAddr(acc_xp, NULL);
+	return R_NilValue;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   acc_xp:  An external pointer to a CoverageAcc struct.
+ *   start:   An integer vector.
+ *   width:   An integer vector of the same length as 'start', with no
+ *            negative values.
+ *   weight:  A numeric (integer or double) vector of the same length as
+ *            'start'. An integer vector cannot contain NAs.
+ * The ranges are clipped with respect to the [1, cvg_len] interval (or the
+ * [1, +inf) interval if the length of the coverage vector is inferred).
+ */
+SEXP CoverageAcc_add(SEXP acc_xp, SEXP start, SEXP width, SEXP weight)
+{
+	CoverageAcc *acc;
+	int x_len, min_nelt, i, s, e;
+	const int *start_p, *width_p;
+	long long int tmp, int_w;
+	double double_w;
+
+	acc = get_CoverageAcc(acc_xp);
+	x_len = check_integer_pairs(start, width, &start_p, &width_p,
+				    "start", "width");
+	check_arg_is_numeric(weight, "weight");
+	if (LENGTH(weight) != x_len)
+		error("'weight' must have the length of 'start'");
+	for (i = 0; i < x_len; i++) {
+		if (start_p[i] == NA_INTEGER)
+			error("'start' cannot contain NAs");
+		if (width_p[i] == NA_INTEGER || width_p[i] < 0)
+			error("'width' cannot contain NAs or negative values");
+		if (IS_INTEGER(weight) && INTEGER(weight)[i] == NA_INTEGER)
+			error("'weight' cannot contain NAs");
+	}
+	if (!IS_INTEGER(weight) && !acc->is_double)
+		switch_CoverageAcc_to_double(acc);
+	if (x_len == 0)
+		return R_NilValue;
+
+	/* Make room for 2 * x_len events. */
+	min_nelt = acc->compacted_nelt * 2;
+	if (min_nelt < ACC_MIN_BUFLENGTH)
+		min_nelt = ACC_MIN_BUFLENGTH;
+	if (acc->nelt >= min_nelt)
+		compact_CoverageAcc(acc);
+	tmp = (long long int) acc->nelt + 2LL * x_len;
+	if (tmp > INT_MAX)
+		error("CoverageAcc: too many events");
+	if (tmp > acc->buflength) {
+		tmp = tmp > 2LL * acc->buflength ? tmp : 2LL * acc->buflength;
+		if (tmp < ACC_MIN_BUFLENGTH)
+			tmp = ACC_MIN_BUFLENGTH;
+		if (tmp > INT_MAX)
+			tmp = INT_MAX;
+		realloc_CoverageAcc(acc, (int) tmp);
+	}
+
+	for (i = 0; i < x_len; i++) {
+		s = start_p[i];
+		tmp = (long long int) s + width_p[i] - 1;  /* the end */
+		if (s < 1)
+			s = 1;
+		if (acc->cvg_len != NA_INTEGER && tmp > acc->cvg_len)
+			tmp = acc->cvg_len;
+		/* Like in shift_and_clip_ranges(), an empty range can extend
+		   an inferred coverage vector. */
+		if (tmp > acc->max_end)
+			acc->max_end = (int) tmp;
+		if (tmp < s)
+			continue;  /* nothing left after clipping */
+		e = (int) tmp;
+		if (acc->is_double) {
+			double_w = IS_INTEGER(weight) ?
+				   (double) INTEGER(weight)[i] :
+				   REAL(weight)[i];
+			acc->pos[acc->nelt] = s;
+			acc->double_delta[acc->nelt++] = double_w;
+			if (e < INT_MAX) {
+				acc->pos[acc->nelt] = e + 1;
+				acc->double_delta[acc->nelt++] = - double_w;
+			}
+		} else {
+			int_w = INTEGER(weight)[i];
+			acc->pos[acc->nelt] = s;
+			acc->int_delta[acc->nelt++] = int_w;
+			if (e < INT_MAX) {
+				acc->pos[acc->nelt] = e + 1;
+				acc->int_delta[acc->nelt++] = - int_w;
+			}
+		}
+	}
+	return R_NilValue;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Returns the coverage accumulated so far as an Rle object. An integer-Rle
+ * is returned if all the weights added so far are integers. In that case,
+ * the coverage is set to NA (with a warning) from the first position where
+ * it doesn't fit in an integer to the end, like add_ints() does for
+ * coverage().
+ */
+SEXP CoverageAcc_as_Rle(SEXP acc_xp)
+{
+	CoverageAcc *acc;
+	int cvg_len, max_nrun, nrun, prev_pos, ovflow, *lengths, *int_values,
+	    k, p;
+	long long int int_cumsum;
+	double *double_values, double_cumsum;
+
+	acc = get_CoverageAcc(acc_xp);
+	compact_CoverageAcc(acc);
+	cvg_len = acc->cvg_len != NA_INTEGER ? acc->cvg_len : acc->max_end;
+	max_nrun = acc->nelt + 1;
+	lengths = (int *) R_alloc((long) max_nrun, sizeof(int));
+	int_values = NULL;
+	double_values = NULL;
+	if (acc->is_double)
+		double_values = (double *) R_alloc((long) max_nrun,
+						   sizeof(double));
+	else
+		int_values = (int *) R_alloc((long) max_nrun, sizeof(int));
+	nrun = ovflow = 0;
+	int_cumsum = 0;
+	double_cumsum = 0.0;
+	prev_pos = 1;
+	for (k = 0; k <= acc->nelt; k++) {
+		/* The last run ends at 'cvg_len'. */
+		p = k < acc->nelt ? acc->pos[k] : cvg_len + 1;
+		if (p > cvg_len + 1)
+			p = cvg_len + 1;
+		if (p > prev_pos) {
+			lengths[nrun] = p - prev_pos;
+			if (acc->is_double) {
+				double_values[nrun] = double_cumsum;
+			} else if (ovflow || int_cumsum > INT_MAX
+					  || int_cumsum <= INT_MIN) {
+				int_values[nrun] = NA_INTEGER;
+				ovflow = 1;
+			} else {
+				int_values[nrun] = (int) int_cumsum;
+			}
+			nrun++;
+			prev_pos = p;
+		}
+		if (p > cvg_len)
+			break;
+		if (acc->is_double)
+			double_cumsum += acc->double_delta[k];
+		else
+			int_cumsum += acc->int_delta[k];
+	}
+	if (ovflow)
+		warning("NAs produced by integer overflow");
+	return acc->is_double ?
+	       construct_numeric_Rle(double_values, nrun, lengths, 0) :
+	       construct_integer_Rle(int_values, nrun, lengths, 0);
+}
+
+
+/****************************************************************************
+ *        Sweeping the coverage without building it (fused summaries)       *
+ ****************************************************************************/
+
+/* Called on each segment [from, to) where the coverage is 'val' (NA_REAL
+   for an integer NA). */
+typedef void (*SegmentFun)(void *data, int from, int to, double val);
+
+/* Returns the SEids of the ranges in 'job' sorted with sort_SEids(). The
+   buffer is allocated with R_alloc(). */
+static int *get_sorted_SEids(const CoverageJob *job, int *SEids_len)
+{
+	int *SEids;
+
+	SEids = (int *) R_alloc(2 * (long) job->x_len + 1, sizeof(int));
+	*SEids_len = job->int_weight != NULL ?
+		init_SEids_int_weight(SEids, job->x_width, job->x_len,
+				      job->int_weight, job->weight_len) :
+		init_SEids_double_weight(SEids, job->x_width, job->x_len,
+					 job->double_weight, job->weight_len);
+	if (*SEids_len != 0
+	 && !sort_SEids(SEids, *SEids_len, job->x_start, job->x_width))
+		error("memory allocation failed");
+	return SEids;
+}
+
+/* Calls 'fun' on the segments of constant coverage that cover
+   [1, end_pos). The coverage after the last event (0 unless an integer
+   NA was propagated) extends up to 'end_pos'. 'SEids' must be sorted with
+   sort_SEids(). Returns 1 if an integer overflow occurred and 0
+   otherwise. */
+static int sweep_SEids(const CoverageJob *job,
+		const int *SEids, int SEids_len, int end_pos,
+		SegmentFun fun, void *data)
+{
+	int ovflow, curr_pos, prev_pos, index, int_val, int_weight, i;
+	double double_val, double_weight;
+
+	ovflow = 0;
+	int_val = 0;
+	double_val = 0.0;
+	curr_pos = 1;
+	for (i = 0; i < SEids_len; i++, SEids++) {
+		if (i % 500000 == 499999)
+			R_CheckUserInterrupt();
+		prev_pos = curr_pos;
+		index = SEid_TO_1BASED_INDEX(*SEids) - 1;
+		curr_pos = job->x_start[index];
+		if (SEid_IS_END(*SEids))
+			curr_pos += job->x_width[index];
+		if (curr_pos == prev_pos)
+			; /* empty segment */
+		else if (job->int_weight != NULL)
+			fun(data, prev_pos, curr_pos,
+			    int_val == NA_INTEGER ? NA_REAL : int_val);
+		else
+			fun(data, prev_pos, curr_pos, double_val);
+		if (job->int_weight != NULL) {
+			int_weight = job->int_weight[index % job->weight_len];
+			if (SEid_IS_END(*SEids) && int_weight != NA_INTEGER)
+				int_weight = - int_weight;
+			int_val = add_ints(int_val, int_weight, &ovflow);
+		} else {
+			double_weight =
+				job->double_weight[index % job->weight_len];
+			if (SEid_IS_END(*SEids))
+				double_weight = - double_weight;
+			double_val += double_weight;
+		}
+	}
+	if (end_pos > curr_pos)
+		fun(data, curr_pos, end_pos,
+		    job->int_weight == NULL ? double_val :
+		    int_val == NA_INTEGER ? NA_REAL : int_val);
+	return ovflow;
+}
+
+
+/****************************************************************************
+ *                    Coverage islands (fused "slice")                      *
+ ****************************************************************************/
+
+/*
+ * Computes the same ranges as 'slice(coverage(x, ...), lower, upper, ...)'
+ * (and optionally the max and sum of the coverage on each of them) in a
+ * single sweep of the sorted start/end events, without building the
+ * coverage vector.
+ *
+ * Like slice(), a 'lower' of -Inf (resp. an 'upper' of +Inf) is not tested
+ * (so -Inf (resp. +Inf) values are in the slice even if 'include_lower'
+ * (resp. 'include_upper') is FALSE), and NAs are only in the slice if
+ * neither bound is tested. The same rules apply to slice() on an Rle or
+ * RleList below.
+ */
+
+typedef struct islands_bufs_t {
+	double lower, upper;
+	int include_lower, include_upper;
+	int keep_na;  /* whether NAs are in the slice */
+	IntAE *start_buf, *width_buf;
+	DoubleAE *max_buf, *sum_buf;  /* NULL if not requested */
+	int island_start;  /* 0 if no island is open */
+	double island_max, island_sum;
+} IslandsBufs;
+
+static int is_in_slice(const IslandsBufs *bufs, double val)
+{
+	if (ISNAN(val))
+		return bufs->keep_na;
+	if (bufs->include_lower ? val < bufs->lower : val <= bufs->lower)
+		return 0;
+	if (bufs->include_upper ? val > bufs->upper : val >= bufs->upper)
+		return 0;
+	return 1;
+}
+
+static void close_island(IslandsBufs *bufs, int end)
+{
+	if (bufs->island_start == 0)
+		return;
+	IntAE_insert_at(bufs->start_buf, IntAE_get_nelt(bufs->start_buf),
+			bufs->island_start);
+	IntAE_insert_at(bufs->width_buf, IntAE_get_nelt(bufs->width_buf),
+			end - bufs->island_start + 1);
+	if (bufs->max_buf != NULL)
+		DoubleAE_insert_at(bufs->max_buf,
+				   DoubleAE_get_nelt(bufs->max_buf),
+				   bufs->island_max);
+	if (bufs->sum_buf != NULL)
+		DoubleAE_insert_at(bufs->sum_buf,
+				   DoubleAE_get_nelt(bufs->sum_buf),
+				   bufs->island_sum);
+	bufs->island_start = 0;
+	return;
+}
+
+static void init_islands_bufs(IslandsBufs *bufs,
+		SEXP lower, SEXP upper, SEXP include_lower, SEXP include_upper,
+		SEXP with_max, SEXP with_sum)
+{
+	bufs->lower = REAL(lower)[0];
+	bufs->upper = REAL(upper)[0];
+	bufs->include_lower = bufs->lower == R_NegInf ||
+			      LOGICAL(include_lower)[0];
+	bufs->include_upper = bufs->upper == R_PosInf ||
+			      LOGICAL(include_upper)[0];
+	bufs->keep_na = bufs->lower == R_NegInf && bufs->upper == R_PosInf;
+	bufs->start_buf = new_IntAE(0, 0, 0);
+	bufs->width_buf = new_IntAE(0, 0, 0);
+	bufs->max_buf = LOGICAL(with_max)[0] ? new_DoubleAE(0, 0, 0.0) : NULL;
+	bufs->sum_buf = LOGICAL(with_sum)[0] ? new_DoubleAE(0, 0, 0.0) : NULL;
+	bufs->island_start = 0;
+	return;
+}
+
+/* Returns a list of length 'ans_len' (>= 4) with the starts and widths of
+   the islands, and their max (an integer vector if 'int_max' is 1) and sum
+   (or NULLs if not requested). The remaining elements are set to NULL. */
+static SEXP new_islands_list(const IslandsBufs *bufs, int int_max,
+		int ans_len)
+{
+	int n, i;
+	SEXP ans, ans_elt;
+
+	PROTECT(ans = NEW_LIST(ans_len));
+	PROTECT(ans_elt = new_INTEGER_from_IntAE(bufs->start_buf));
+	SET_VECTOR_ELT(ans, 0, ans_elt);
+	UNPROTECT(1);
+	PROTECT(ans_elt = new_INTEGER_from_IntAE(bufs->width_buf));
+	SET_VECTOR_ELT(ans, 1, ans_elt);
+	UNPROTECT(1);
+	if (bufs->max_buf != NULL) {
+		n = DoubleAE_get_nelt(bufs->max_buf);
+		if (int_max) {
+			PROTECT(ans_elt = NEW_INTEGER(n));
+			for (i = 0; i < n; i++)
+				INTEGER(ans_elt)[i] =
+				    ISNAN(bufs->max_buf->elts[i]) ?
+				    NA_INTEGER : (int) bufs->max_buf->elts[i];
+		} else {
+			PROTECT(ans_elt = new_NUMERIC_from_DoubleAE(
+							bufs->max_buf));
+		}
+		SET_VECTOR_ELT(ans, 2, ans_elt);
+		UNPROTECT(1);
+	}
+	if (bufs->sum_buf != NULL) {
+		PROTECT(ans_elt = new_NUMERIC_from_DoubleAE(bufs->sum_buf));
+		SET_VECTOR_ELT(ans, 3, ans_elt);
+		UNPROTECT(1);
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+/* A SegmentFun. */
+static void add_segment_to_islands(void *data, int from, int to, double val)
+{
+	IslandsBufs *bufs = (IslandsBufs *) data;
+
+	if (!is_in_slice(bufs, val)) {
+		close_island(bufs, from - 1);
+		return;
+	}
+	if (bufs->island_start == 0) {
+		bufs->island_start = from;
+		bufs->island_max = val;
+		bufs->island_sum = 0.0;
+	} else if (ISNAN(val) || val > bufs->island_max) {
+		bufs->island_max = val;
+	}
+	bufs->island_sum += val * (to - from);
+	return;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   x, shift, width, weight: See IRanges_coverage().
+ *   lower, upper:            Single numbers.
+ *   include_lower,
+ *   include_upper:           TRUE or FALSE.
+ *   with_max, with_sum:      TRUE or FALSE.
+ * Returns NULL if the ranges form a tiling (the coverage is then simply
+ * the weights), or a list of 4 elements: the starts and widths of the
+ * islands, and their max and sum coverage (or NULLs if not requested). The
+ * max is an integer vector if 'weight' is an integer vector and the sum is
+ * always a numeric vector.
+ */
+SEXP IRanges_coverage_islands(SEXP x, SEXP shift, SEXP width, SEXP weight,
+		SEXP lower, SEXP upper, SEXP include_lower, SEXP include_upper,
+		SEXP with_max, SEXP with_sum)
+{
+	CoverageJob job;
+	IslandsBufs bufs;
+	int *SEids, SEids_len, ovflow;
+	SEXP circle_len, method, ans;
+
+	PROTECT(circle_len = ScalarInteger(NA_INTEGER));
+	PROTECT(method = mkString("sort"));
+	ans = prepare_IRanges_coverage_job(x, shift, width, weight,
+					   circle_len, method, &job);
+	UNPROTECT(2);
+	if (ans != R_NilValue)
+		return R_NilValue;
+	init_islands_bufs(&bufs, lower, upper, include_lower, include_upper,
+			  with_max, with_sum);
+
+	SEids = get_sorted_SEids(&job, &SEids_len);
+	ovflow = sweep_SEids(&job, SEids, SEids_len, job.cvg_len + 1,
+			     add_segment_to_islands, &bufs);
+	close_island(&bufs, job.cvg_len);
+	if (ovflow)
+		warning("NAs produced by integer overflow");
+
+	return new_islands_list(&bufs, job.int_weight != NULL, 4);
+}
+
+
+/*
+ * slice() on an Rle or RleList: the islands are computed in a single scan
+ * of the runs, without building the logical Rle objects 'x >= lower' and
+ * 'x <= upper'.
+ */
+
+/* Returns 1 if the values of 'x' are integers (or logicals). */
+static int add_Rle_to_islands(IslandsBufs *bufs, SEXP x)
+{
+	SEXP values, lengths;
+	int nrun, k, is_int, pos, len, iv;
+	double val;
+
+	values = GET_SLOT(x, install("values"));
+	lengths = GET_SLOT(x, install("lengths"));
+	is_int = IS_INTEGER(values) || IS_LOGICAL(values);
+	if (!is_int && !IS_NUMERIC(values))
+		error("slice() only supports Rle objects with logical, "
+		      "integer, or numeric values");
+	nrun = LENGTH(lengths);
+	pos = 1;
+	for (k = 0; k < nrun; k++) {
+		len = INTEGER(lengths)[k];
+		if (is_int) {
+			iv = INTEGER(values)[k];
+			val = iv == NA_INTEGER ? NA_REAL : (double) iv;
+		} else {
+			val = REAL(values)[k];
+		}
+		add_segment_to_islands(bufs, pos, pos + len, val);
+		pos += len;
+	}
+	close_island(bufs, pos - 1);
+	return is_int;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   x:                       An Rle object with logical, integer, or
+ *                            numeric values.
+ *   lower, upper:            Single numbers.
+ *   include_lower,
+ *   include_upper:           TRUE or FALSE.
+ *   with_max, with_sum:      TRUE or FALSE.
+ * Returns a list of 4 elements like IRanges_coverage_islands().
+ */
+SEXP Rle_slice(SEXP x, SEXP lower, SEXP upper,
+		SEXP include_lower, SEXP include_upper,
+		SEXP with_max, SEXP with_sum)
+{
+	IslandsBufs bufs;
+	int is_int;
+
+	init_islands_bufs(&bufs, lower, upper, include_lower, include_upper,
+			  with_max, with_sum);
+	is_int = add_Rle_to_islands(&bufs, x);
+	return new_islands_list(&bufs, is_int, 4);
+}
+
+/* --- .Call ENTRY POINT ---
+ * Same as Rle_slice() except that 'x' must be a list of Rle objects. The
+ * islands of all the Rle objects are returned in a list of 5 elements: the
+ * 4 elements returned by Rle_slice() plus the cumulated nb of islands of
+ * each Rle object (to partition them). The max is an integer vector if the
+ * values of all the Rle objects are integers (or logicals).
+ */
+SEXP RleList_slice(SEXP x, SEXP lower, SEXP upper,
+		SEXP include_lower, SEXP include_upper,
+		SEXP with_max, SEXP with_sum)
+{
+	IslandsBufs bufs;
+	int x_len, i, all_int;
+	SEXP breakpoints, ans;
+
+	init_islands_bufs(&bufs, lower, upper, include_lower, include_upper,
+			  with_max, with_sum);
+	x_len = LENGTH(x);
+	PROTECT(breakpoints = NEW_INTEGER(x_len));
+	all_int = 1;
+	for (i = 0; i < x_len; i++) {
+		if (!add_Rle_to_islands(&bufs, VECTOR_ELT(x, i)))
+			all_int = 0;
+		INTEGER(breakpoints)[i] = IntAE_get_nelt(bufs.start_buf);
+	}
+	PROTECT(ans = new_islands_list(&bufs, all_int, 5));
+	SET_VECTOR_ELT(ans, 4, breakpoints);
+	UNPROTECT(2);
+	return ans;
+}
+
+
+/****************************************************************************
+ *                   Binned coverage (fused "viewSums" etc)                 *
+ ****************************************************************************/
+
+/*
+ * Computes the same values as 'viewSums(Views(coverage(x, ...), bins))'
+ * (or viewMeans, viewMaxs, viewMins) in a single sweep of the sorted
+ * start/end events, without building the coverage vector. The bins must
+ * be sorted and non-overlapping so they can be walked along with the
+ * segments of constant coverage. The sums of integer coverage values are
+ * accumulated exactly (in a long long int) so they can be returned as
+ * integers, like viewSums() does.
+ */
+
+#define	BINNED_SUM 1
+#define	BINNED_MEAN 2
+#define	BINNED_MAX 3
+#define	BINNED_MIN 4
+
+typedef struct bins_bufs_t {
+	const int *bin_start, *bin_width;
+	int nbin;
+	int fun;  /* BINNED_SUM, BINNED_MEAN, BINNED_MAX, or BINNED_MIN */
+	int curr_bin;
+	double *vals;
+	/* NULL or the sums of the integer coverage values. Then 'vals' is
+	   only used to flag the bins that contain NAs (as NA_REAL). */
+	long long int *isums;
+} BinsBufs;
+
+/* A SegmentFun. */
+static void add_segment_to_bins(void *data, int from, int to, double val)
+{
+	BinsBufs *bufs = (BinsBufs *) data;
+	int bin_start, bin_end, from0, to0;
+	double *bin_val;
+
+	for ( ; bufs->curr_bin < bufs->nbin; bufs->curr_bin++) {
+		bin_start = bufs->bin_start[bufs->curr_bin];
+		/* 'bin_end' is the first position after the bin */
+		bin_end = bin_start + bufs->bin_width[bufs->curr_bin];
+		if (bin_end <= from || bin_end == bin_start)
+			continue;
+		if (bin_start >= to)
+			return;
+		from0 = bin_start > from ? bin_start : from;
+		to0 = bin_end < to ? bin_end : to;
+		bin_val = bufs->vals + bufs->curr_bin;
+		switch (bufs->fun) {
+		    case BINNED_SUM: case BINNED_MEAN:
+			if (bufs->isums == NULL)
+				*bin_val += val * (to0 - from0);
+			else if (ISNAN(val))
+				*bin_val = NA_REAL;
+			else
+				bufs->isums[bufs->curr_bin] +=
+					(long long int) val * (to0 - from0);
+			break;
+		    case BINNED_MAX:
+			if (ISNAN(val) || val > *bin_val)
+				*bin_val = val;
+			break;
+		    case BINNED_MIN:
+			if (ISNAN(val) || val < *bin_val)
+				*bin_val = val;
+			break;
+		}
+		if (bin_end > to)
+			return;  /* the bin continues in the next segment */
+	}
+	return;
+}
+
+/* Returns the first position after the last bin. The bins must be within
+   [1, cvg_len]. */
+static int check_bins(const int *bin_start, const int *bin_width, int nbin,
+		int cvg_len)
+{
+	int prev_end, i;
+
+	prev_end = 1;
+	for (i = 0; i < nbin; i++) {
+		if (bin_start[i] < prev_end)
+			error("the bins must be sorted, non-overlapping, "
+			      "and within [1, +inf)");
+		prev_end = bin_start[i] + bin_width[i];
+	}
+	if (prev_end - 1 > cvg_len)
+		error("the bins must be within the coverage vector "
+		      "(i.e. within [1, %d])", cvg_len);
+	return prev_end;
+}
+
+/* Tiles of width 'bin_width' that cover [1, cvg_len]. The last one can be
+   shorter. */
+static int make_tiles(int cvg_len, int bin_width,
+		int **bin_start, int **bin_widths)
+{
+	int nbin, i;
+
+	nbin = cvg_len / bin_width + (cvg_len % bin_width != 0);
+	*bin_start = (int *) R_alloc(nbin, sizeof(int));
+	*bin_widths = (int *) R_alloc(nbin, sizeof(int));
+	for (i = 0; i < nbin; i++) {
+		(*bin_start)[i] = i * bin_width + 1;
+		(*bin_widths)[i] = i < nbin - 1 ?
+				   bin_width : cvg_len - i * bin_width;
+	}
+	return nbin;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   x, shift, width, weight: See IRanges_coverage().
+ *   bin_start, bin_width:    Integer vectors of the same length describing
+ *                            sorted non-overlapping bins. If 'bin_start'
+ *                            is NULL, 'bin_width' must be a single positive
+ *                            integer and the bins are the tiles of that
+ *                            width that cover the coverage vector.
+ *   fun:                     "sum", "mean", "max", or "min".
+ * Returns NULL if the ranges form a tiling (the coverage is then simply
+ * the weights), or a vector parallel to the bins. The "sum", "max", and
+ * "min" summaries are integers if 'weight' is an integer vector. The
+ * summaries of the empty bins are 0 for "sum" and NA for the others.
+ */
+SEXP IRanges_binned_coverage(SEXP x, SEXP shift, SEXP width, SEXP weight,
+		SEXP bin_start, SEXP bin_width, SEXP fun)
+{
+	CoverageJob job;
+	BinsBufs bufs;
+	const char *fun0;
+	int *SEids, *tile_start, *tile_width, SEids_len, end_pos, ovflow, i;
+	double init_val;
+	SEXP circle_len, method, ans;
+
+	if (!IS_CHARACTER(fun) || LENGTH(fun) != 1)
+		error("'FUN' must be a single string");
+	fun0 = CHAR(STRING_ELT(fun, 0));
+	if (strcmp(fun0, "sum") == 0) {
+		bufs.fun = BINNED_SUM;
+		init_val = 0.0;
+	} else if (strcmp(fun0, "mean") == 0) {
+		bufs.fun = BINNED_MEAN;
+		init_val = 0.0;
+	} else if (strcmp(fun0, "max") == 0) {
+		bufs.fun = BINNED_MAX;
+		init_val = R_NegInf;
+	} else if (strcmp(fun0, "min") == 0) {
+		bufs.fun = BINNED_MIN;
+		init_val = R_PosInf;
+	} else {
+		error("'FUN' must be \"sum\", \"mean\", \"max\", or \"min\"");
+	}
+
+	PROTECT(circle_len = ScalarInteger(NA_INTEGER));
+	PROTECT(method = mkString("sort"));
+	ans = prepare_IRanges_coverage_job(x, shift, width, weight,
+					   circle_len, method, &job);
+	UNPROTECT(2);
+	if (ans != R_NilValue)
+		return R_NilValue;
+
+	check_arg_is_integer(bin_width, "bin_width");
+	if (bin_start == R_NilValue) {
+		if (LENGTH(bin_width) != 1
+		 || INTEGER(bin_width)[0] == NA_INTEGER
+		 || INTEGER(bin_width)[0] <= 0)
+			error("'bins' must be a single positive integer");
+		bufs.nbin = make_tiles(job.cvg_len, INTEGER(bin_width)[0],
+				       &tile_start, &tile_width);
+		bufs.bin_start = tile_start;
+		bufs.bin_width = tile_width;
+		end_pos = job.cvg_len + 1;
+	} else {
+		check_arg_is_integer(bin_start, "bin_start");
+		bufs.bin_start = INTEGER(bin_start);
+		bufs.bin_width = INTEGER(bin_width);
+		bufs.nbin = LENGTH(bin_start);
+		end_pos = check_bins(bufs.bin_start, bufs.bin_width,
+				     bufs.nbin, job.cvg_len);
+	}
+	bufs.curr_bin = 0;
+	bufs.vals = (double *) R_alloc(bufs.nbin + 1, sizeof(double));
+	for (i = 0; i < bufs.nbin; i++)
+		bufs.vals[i] = init_val;
+	bufs.isums = NULL;
+	if (job.int_weight != NULL && bufs.fun == BINNED_SUM) {
+		bufs.isums = (long long int *)
+			R_alloc(bufs.nbin + 1, sizeof(long long int));
+		for (i = 0; i < bufs.nbin; i++)
+			bufs.isums[i] = 0;
+	}
+
+	SEids = get_sorted_SEids(&job, &SEids_len);
+	ovflow = sweep_SEids(&job, SEids, SEids_len, end_pos,
+			     add_segment_to_bins, &bufs);
+	if (ovflow)
+		warning("NAs produced by integer overflow");
+
+	if (bufs.isums != NULL) {
+		PROTECT(ans = NEW_INTEGER(bufs.nbin));
+		for (i = 0; i < bufs.nbin; i++) {
+			if (ISNAN(bufs.vals[i])) {
+				INTEGER(ans)[i] = NA_INTEGER;
+				continue;
+			}
+			if (bufs.isums[i] > INT_MAX
+			 || bufs.isums[i] <= INT_MIN)
+				error("Integer overflow");
+			INTEGER(ans)[i] = (int) bufs.isums[i];
+		}
+	} else if (job.int_weight != NULL
+		&& (bufs.fun == BINNED_MAX || bufs.fun == BINNED_MIN))
+	{
+		PROTECT(ans = NEW_INTEGER(bufs.nbin));
+		for (i = 0; i < bufs.nbin; i++)
+			INTEGER(ans)[i] = bufs.bin_width[i] == 0
+				       || ISNAN(bufs.vals[i]) ?
+					NA_INTEGER : (int) bufs.vals[i];
+	} else {
+		PROTECT(ans = NEW_NUMERIC(bufs.nbin));
+		for (i = 0; i < bufs.nbin; i++) {
+			if (bufs.bin_width[i] == 0 && bufs.fun != BINNED_SUM)
+				REAL(ans)[i] = NA_REAL;
+			else if (bufs.fun == BINNED_MEAN)
+				REAL(ans)[i] = bufs.vals[i] /
+					       bufs.bin_width[i];
+			else
+				REAL(ans)[i] = bufs.vals[i];
+		}
+	}
+	UNPROTECT(1);
+	return ans;
+}
+
+
+/****************************************************************************
+ *                 Multi-sample coverage (coverage matrix)                  *
+ ****************************************************************************/
+
+/*
+ * The coverage of several samples over the same sequence is computed in a
+ * single sweep of the merged start/end events of all the samples. The
+ * result is a set of runs shared by all the samples (a new run starts
+ * wherever the coverage of at least 1 sample changes) and a matrix of
+ * values with 1 row per sample and 1 column per run.
+ */
+
+typedef struct sample_events_t {
+	int nevent;
+	unsigned long long *keys;  /* event position in the upper 32 bits,
+				      event id in the lower 32 bits */
+	int *sample;               /* 0-based sample of each event */
+	int *int_delta;            /* NULL if the weights are doubles */
+	double *double_delta;
+} SampleEvents;
+
+static void add_sample_event(SampleEvents *events, int pos, int sample,
+		int int_delta, double double_delta)
+{
+	int k;
+
+	k = events->nevent++;
+	events->keys[k] = ((unsigned long long) (unsigned int) pos << 32) |
+			  (unsigned int) k;
+	events->sample[k] = sample;
+	if (events->int_delta != NULL)
+		events->int_delta[k] = int_delta;
+	else
+		events->double_delta[k] = double_delta;
+	return;
+}
+
+/* The start/end events of the shifted and clipped ranges of 1 sample. */
+static void add_sample_events(SampleEvents *events, int sample,
+		const IntPairAE *ranges, SEXP weight)
+{
+	int x_len, weight_len, i, j, start, width, int_w;
+	double double_w;
+
+	x_len = IntPairAE_get_nelt(ranges);
+	weight_len = LENGTH(weight);
+	for (i = j = 0; i < x_len; i++, j++) {
+		if (j >= weight_len)
+			j = 0; /* recycle j */
+		start = ranges->a->elts[i];
+		width = ranges->b->elts[i];
+		if (width == 0)
+			continue;
+		if (IS_INTEGER(weight)) {
+			int_w = INTEGER(weight)[j];
+			if (int_w == 0)
+				continue;
+			double_w = int_w == NA_INTEGER ? NA_REAL : int_w;
+		} else {
+			double_w = REAL(weight)[j];
+			if (double_w == 0.0)
+				continue;
+			int_w = 0;  /* not used */
+		}
+		add_sample_event(events, start, sample, int_w, double_w);
+		add_sample_event(events, start + width, sample,
+				 int_w == NA_INTEGER ? int_w : - int_w,
+				 - double_w);
+	}
+	return;
+}
+
+/* --- .Call ENTRY POINT ---
+ * Args:
+ *   x:      A CompressedIRangesList object (1 list element per sample).
+ *   shift:  A list of numeric vectors (recycled to the length of 'x').
+ *   width:  A single integer (NA or >= 0). If NA, the coverage vectors
+ *           are as long as the longest coverage vector of the samples.
+ *   weight: A list of numeric vectors (recycled to the length of 'x').
+ * Returns a list of 2 elements: the lengths of the shared runs, and the
+ * matrix of values (integer if all the weights are integers, numeric
+ * otherwise) with 1 row per sample and 1 column per run.
+ */
+SEXP CompressedIRangesList_coverage_matrix(SEXP x, SEXP shift, SEXP width,
+		SEXP weight)
+{
+	CompressedIRangesList_holder x_holder;
+	IRanges_holder x_elt_holder;
+	IntPairAE **ranges_bufs;
+	SampleEvents events;
+	unsigned long long *keys2, *sorted_keys;
+	int nsample, shift_len, weight_len, width0, cvg_len, elt_cvg_len,
+	    tiles, int_weights, nevent, nrun_max, nrun, prev_pos, pos,
+	    ovflow, elt_size, i, j, l, k, id;
+	int *lengths, *int_cur;
+	double *double_cur;
+	char *cur, *cols;
+	size_t col_size;
+	SEXP weight_elt, ans, ans_elt;
+	char x_label_buf[40], shift_label_buf[40], weight_label_buf[40];
+
+	x_holder = _hold_CompressedIRangesList(x);
+	nsample = _get_length_from_CompressedIRangesList_holder(&x_holder);
+
+	check_arg_is_list(shift, "shift");
+	shift_len = LENGTH(shift);
+	check_arg_is_recyclable(shift_len, nsample, "shift", "x");
+	check_arg_is_integer(width, "width");
+	if (LENGTH(width) != 1)
+		error("'%s' must be a single integer", "width");
+	width0 = INTEGER(width)[0];
+	check_arg_is_list(weight, "weight");
+	weight_len = LENGTH(weight);
+	check_arg_is_recyclable(weight_len, nsample, "weight", "x");
+
+	/* 1st pass: shift and clip the ranges of each sample. */
+	x_label = x_label_buf;
+	shift_label = shift_label_buf;
+	width_label = "width";
+	weight_label = weight_label_buf;
+	ranges_bufs = (IntPairAE **) R_alloc((long) nsample + 1,
+					     sizeof(IntPairAE *));
+	cvg_len = width0 == NA_INTEGER ? 0 : width0;
+	int_weights = 1;
+	nevent = 0;
+	for (i = j = l = 0; i < nsample; i++, j++, l++) {
+		if (j >= shift_len)
+			j = 0; /* recycle j */
+		if (l >= weight_len)
+			l = 0; /* recycle l */
+		snprintf(x_label_buf, sizeof(x_label_buf), "x[[%d]]", i + 1);
+		snprintf(shift_label_buf, sizeof(shift_label_buf),
+			 "shift[[%d]]", j + 1);
+		snprintf(weight_label_buf, sizeof(weight_label_buf),
+			 "weight[[%d]]", l + 1);
+		x_elt_holder = _get_elt_from_CompressedIRangesList_holder(
+						&x_holder, i);
+		ranges_bufs[i] = new_IntPairAE(0, 0);
+		elt_cvg_len = shift_and_clip_ranges(&x_elt_holder,
+					VECTOR_ELT(shift, j), width0,
+					NA_INTEGER, ranges_bufs[i], &tiles);
+		if (elt_cvg_len > cvg_len)
+			cvg_len = elt_cvg_len;
+		weight_elt = VECTOR_ELT(weight, l);
+		check_arg_is_numeric(weight_elt, weight_label);
+		check_arg_is_recyclable(LENGTH(weight_elt),
+				_get_length_from_IRanges_holder(&x_elt_holder),
+				weight_label, x_label);
+		if (!IS_INTEGER(weight_elt))
+			int_weights = 0;
+		nevent += 2 * IntPairAE_get_nelt(ranges_bufs[i]);
+	}
+	check_recycling_was_round(j, shift_len, "shift", "x");
+	check_recycling_was_round(l, weight_len, "weight", "x");
+
+	/* 2nd pass: collect the events of all the samples and sort them. */
+	events.nevent = 0;
+	events.keys = (unsigned long long *)
+		R_alloc((long) nevent + 1, sizeof(unsigned long long));
+	keys2 = (unsigned long long *)
+		R_alloc((long) nevent + 1, sizeof(unsigned long long));
+	events.sample = (int *) R_alloc((long) nevent + 1, sizeof(int));
+	events.int_delta = NULL;
+	events.double_delta = NULL;
+	if (int_weights)
+		events.int_delta = (int *)
+			R_alloc((long) nevent + 1, sizeof(int));
+	else
+		events.double_delta = (double *)
+			R_alloc((long) nevent + 1, sizeof(double));
+	for (i = l = 0; i < nsample; i++, l++) {
+		if (l >= weight_len)
+			l = 0; /* recycle l */
+		add_sample_events(&events, i, ranges_bufs[i],
+				  VECTOR_ELT(weight, l));
+	}
+	nevent = events.nevent;
+	sorted_keys = radix_sort_keys(events.keys, keys2, nevent);
+
+	/* 3rd pass: the sweep. A column of values is appended for each
+	   segment of constant coverage (or the last run is extended if no
+	   sample changed). */
+	for (k = 0, nrun_max = 1; k < nevent; k++)
+		if (k == 0
+		 || (sorted_keys[k] >> 32) != (sorted_keys[k - 1] >> 32))
+			nrun_max++;
+	if (nrun_max > cvg_len)
+		nrun_max = cvg_len;
+	elt_size = int_weights ? sizeof(int) : sizeof(double);
+	lengths = (int *) R_alloc((long) nrun_max + 1, sizeof(int));
+	cols = R_alloc(((size_t) nrun_max + 1) * nsample + 1, elt_size);
+	col_size = (size_t) nsample * elt_size;
+	cur = R_alloc((size_t) nsample + 1, elt_size);
+	memset(cur, 0, col_size);
+	int_cur = (int *) cur;
+	double_cur = (double *) cur;
+	nrun = 0;
+	prev_pos = 1;
+	ovflow = 0;
+	for (k = 0; k <= nevent; k++) {
+		pos = k < nevent ? (int) (sorted_keys[k] >> 32) : cvg_len + 1;
+		if (pos > prev_pos) {
+			if (nrun != 0
+			 && memcmp(cols + (nrun - 1) * col_size, cur,
+				   col_size) == 0)
+			{
+				lengths[nrun - 1] += pos - prev_pos;
+			} else {
+				memcpy(cols + nrun * col_size, cur, col_size);
+				lengths[nrun++] = pos - prev_pos;
+			}
+			prev_pos = pos;
+		}
+		if (k == nevent)
+			break;
+		id = (int) (sorted_keys[k] & 0xffffffffU);
+		i = events.sample[id];
+		if (int_weights)
+			int_cur[i] = add_ints(int_cur[i],
+					      events.int_delta[id], &ovflow);
+		else
+			double_cur[i] += events.double_delta[id];
+	}
+	if (ovflow)
+		warning("NAs produced by integer overflow");
+
+	PROTECT(ans = NEW_LIST(2));
+	PROTECT(ans_elt = NEW_INTEGER(nrun));
+	memcpy(INTEGER(ans_elt), lengths, sizeof(int) * nrun);
+	SET_VECTOR_ELT(ans, 0, ans_elt);
+	UNPROTECT(1);
+	PROTECT(ans_elt = allocMatrix(int_weights ? INTSXP : REALSXP,
+				      nsample, nrun));
+	memcpy(int_weights ? (void *) INTEGER(ans_elt) : (void *) REAL(ans_elt),
+	       cols, nrun * col_size);
+	SET_VECTOR_ELT(ans, 1, ans_elt);
+	UNPROTECT(2);
+	return ans;
+}
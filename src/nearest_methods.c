@@ -0,0 +1,270 @@
+/****************************************************************************
+ *                     Fast distanceToNearest() kernel                      *
+ ****************************************************************************/
+#include "IRanges.h"
+#include "S4Vectors_interface.h"
+
+#include <R_ext/Utils.h> /* for R_CheckUserInterrupt() */
+
+
+/****************************************************************************
+ * Low-level helper functions.
+ */
+
+/* Same as the "distance" method for Ranges objects. */
+static int get_distance(int x_start, int x_end, int y_start, int y_end)
+{
+	int max_start, min_end, d;
+
+	max_start = x_start >= y_start ? x_start : y_start;
+	min_end = x_end <= y_end ? x_end : y_end;
+	d = max_start - min_end - 1;
+	return d >= 0 ? d : 0;
+}
+
+/* Return the 0-based indices of the ranges sorted by 'key' first, then by
+   index. This is the order returned by 'base::order(key)' (which is stable)
+   minus 1. */
+static int *get_order_by_key_then_index(const int *key, int len)
+{
+	int *base, *index, i, retcode;
+
+	base = (int *) R_alloc((long) len, sizeof(int));
+	index = (int *) R_alloc((long) len, sizeof(int));
+	for (i = 0; i < len; i++)
+		base[i] = index[i] = i;
+	retcode = sort_int_pairs(base, len, key, index, 0, 0, 1, NULL, NULL);
+	if (retcode != 0)
+		error("IRanges internal error in "
+		      "get_order_by_key_then_index(): "
+		      "memory allocation failed");
+	return base;
+}
+
+/*
+ * 'subset_len' is assumed to be > 0.
+ * Return the first index 'n' for which 'base[subset[n]] > max', or
+ * 'subset_len' if there is no such index.
+ */
+static int int_bsearch_gt(const int *subset, int subset_len, const int *base,
+		int max)
+{
+	int n1, n2, n;
+
+	if (base[subset[0]] > max)
+		return 0;
+	n2 = subset_len - 1;
+	if (base[subset[n2]] <= max)
+		return subset_len;
+	/* At this point base[subset[n1]] <= max < base[subset[n2]]. */
+	n1 = 0;
+	while ((n = (n1 + n2) >> 1) != n1) {
+		if (base[subset[n]] <= max)
+			n1 = n;
+		else
+			n2 = n;
+	}
+	return n2;
+}
+
+static void append_hit(IntAE *qh_buf, IntAE *sh_buf, IntAE *dist_buf,
+		int q_rgid1, int s_rgid1, int dist)
+{
+	IntAE_insert_at(qh_buf, IntAE_get_nelt(qh_buf), q_rgid1);
+	IntAE_insert_at(sh_buf, IntAE_get_nelt(sh_buf), s_rgid1);
+	IntAE_insert_at(dist_buf, IntAE_get_nelt(dist_buf), dist);
+	return;
+}
+
+
+/****************************************************************************
+ * Ranges_distanceToNearest()
+ *
+ * --- .Call ENTRY POINT ---
+ * Args:
+ *   x_start, x_end: Integer vectors of same length.
+ *   s_start, s_end: Integer vectors of same length.
+ *   select_all:     TRUE or FALSE.
+ *   drop_self:      TRUE or FALSE. TRUE when the subject is 'x' itself, in
+ *                   which case the self overlaps are ignored.
+ * Implements the same semantic as nearest() followed by distance() i.e.
+ * for each range in 'x':
+ *   1. If it overlaps ranges in the subject, report them (all of them if
+ *      'select_all' is TRUE, an arbitrary one otherwise) with distance 0.
+ *   2. Otherwise report the subject ranges with the smallest start greater
+ *      than its end (i.e. what precede() returns) if they are closer than
+ *      the ranges with the greatest end smaller than its start (i.e. what
+ *      follow() returns), or the latter if they are closer. On a tie, both
+ *      sets are reported when 'select_all' is TRUE, and the follow() range
+ *      otherwise.
+ * The overlaps are found with the NCList engine, preprocessing the shortest
+ * of 'x' and the subject like findOverlaps() does (so the arbitrary hit is
+ * the same). Then the subject ranges are sorted once by start and once by
+ * end, and the precede() and follow() candidates of each range in 'x' are
+ * located by binary search. No Hits object is created and distance() is not
+ * called.
+ * Returns a list of 3 parallel integer vectors: the query hits, the subject
+ * hits, and the distances. The hits are sorted by query and then by subject.
+ */
+SEXP Ranges_distanceToNearest(SEXP x_start, SEXP x_end,
+		SEXP s_start, SEXP s_end,
+		SEXP select_all, SEXP drop_self)
+{
+	int x_len, s_len, select_all0, drop_self0, *direct_out,
+	    *s_order_by_start, *s_order_by_end,
+	    i, i1, n, n2, nov, old_nhit, k1, k2, k1_end, k2_start,
+	    q_start, q_end, s_rgid, s_rgid1, s_rgid2,
+	    has_left, has_right, left_dist, right_dist, go_left, go_right;
+	const int *x_start_p, *x_end_p, *s_start_p, *s_end_p;
+	IntAE *ovq_buf, *ovs_buf, *qh_buf, *sh_buf, *dist_buf;
+	SEXP ans, ans_elt;
+
+	x_len = check_integer_pairs(x_start, x_end,
+				    &x_start_p, &x_end_p,
+				    "start(x)", "end(x)");
+	s_len = check_integer_pairs(s_start, s_end,
+				    &s_start_p, &s_end_p,
+				    "start(subject)", "end(subject)");
+	select_all0 = LOGICAL(select_all)[0];
+	drop_self0 = LOGICAL(drop_self)[0];
+
+	qh_buf = new_IntAE(0, 0, 0);
+	sh_buf = new_IntAE(0, 0, 0);
+	dist_buf = new_IntAE(0, 0, 0);
+	if (x_len == 0 || s_len == 0)
+		goto make_ans;
+
+	/* 1st: find the overlaps. We need all of them when the self overlaps
+	   must be dropped, even if 'select_all' is FALSE, because the
+	   arbitrary hit could be a self hit. */
+	ovq_buf = new_IntAE(0, 0, 0);
+	ovs_buf = new_IntAE(0, 0, 0);
+	direct_out = NULL;
+	if (!(select_all0 || drop_self0)) {
+		direct_out = (int *) R_alloc((long) x_len, sizeof(int));
+		for (i = 0; i < x_len; i++)
+			direct_out[i] = NA_INTEGER;
+	}
+	_find_any_overlaps(x_start_p, x_end_p, x_len,
+			   s_start_p, s_end_p, s_len,
+			   direct_out == NULL ? ALL_HITS : ARBITRARY_HIT,
+			   ovq_buf, ovs_buf, direct_out);
+
+	/* 2nd: sort the subject by start and by end. */
+	s_order_by_start = get_order_by_key_then_index(s_start_p, s_len);
+	s_order_by_end = get_order_by_key_then_index(s_end_p, s_len);
+
+	/* 3rd: walk on 'x'. */
+	n = 0;  /* current position in 'ovq_buf' and 'ovs_buf' */
+	n2 = IntAE_get_nelt(ovq_buf);
+	for (i = 0, i1 = 1; i < x_len; i++, i1++) {
+		if (i % 500000 == 499999)
+			R_CheckUserInterrupt();
+		if (direct_out != NULL) {
+			s_rgid1 = direct_out[i];
+			if (s_rgid1 != NA_INTEGER) {
+				append_hit(qh_buf, sh_buf, dist_buf,
+					   i1, s_rgid1, 0);
+				continue;
+			}
+		} else {
+			nov = 0;
+			old_nhit = IntAE_get_nelt(sh_buf);
+			for ( ; n < n2 && ovq_buf->elts[n] == i1; n++) {
+				s_rgid1 = ovs_buf->elts[n];
+				if (drop_self0 && s_rgid1 == i1)
+					continue;
+				if (!select_all0 && nov != 0)
+					continue;
+				append_hit(qh_buf, sh_buf, dist_buf,
+					   i1, s_rgid1, 0);
+				nov++;
+			}
+			if (nov != 0) {
+				if (nov >= 2)
+					sort_int_array(sh_buf->elts + old_nhit,
+						       nov, 0);
+				continue;
+			}
+		}
+
+		/* 'x[i]' overlaps nothing. */
+		q_start = x_start_p[i];
+		q_end = x_end_p[i];
+		/* What precede() would return. */
+		k1 = int_bsearch_gt(s_order_by_start, s_len, s_start_p, q_end);
+		has_left = k1 < s_len;
+		/* What follow() would return. */
+		k2 = int_bsearch_gt(s_order_by_end, s_len, s_end_p,
+				    q_start - 1) - 1;
+		has_right = k2 >= 0;
+		if (has_left && has_right) {
+			left_dist = s_start_p[s_order_by_start[k1]] - q_end;
+			right_dist = q_start - s_end_p[s_order_by_end[k2]];
+			go_left = select_all0 ? left_dist <= right_dist :
+						left_dist < right_dist;
+			go_right = select_all0 ? left_dist >= right_dist :
+						 !go_left;
+		} else {
+			go_left = has_left;
+			go_right = has_right;
+		}
+		if (!select_all0) {
+			s_rgid = go_left ? s_order_by_start[k1] :
+					   s_order_by_end[k2];
+			if (go_left || go_right)
+				append_hit(qh_buf, sh_buf, dist_buf,
+					   i1, s_rgid + 1,
+					   get_distance(q_start, q_end,
+							s_start_p[s_rgid],
+							s_end_p[s_rgid]));
+			continue;
+		}
+		/* Merge the 2 sets of candidates (both are sorted by index)
+		   into the buffers. */
+		k1_end = k1;
+		if (go_left) {
+			while (k1_end < s_len
+			    && s_start_p[s_order_by_start[k1_end]] ==
+			       s_start_p[s_order_by_start[k1]])
+				k1_end++;
+		}
+		k2_start = k2 + 1;
+		if (go_right) {
+			while (k2_start > 0
+			    && s_end_p[s_order_by_end[k2_start - 1]] ==
+			       s_end_p[s_order_by_end[k2]])
+				k2_start--;
+		}
+		k2++;
+		while (k1 < k1_end || k2_start < k2) {
+			s_rgid = k1 < k1_end ? s_order_by_start[k1] : -1;
+			s_rgid2 = k2_start < k2 ? s_order_by_end[k2_start] : -1;
+			if (s_rgid == -1 || (s_rgid2 != -1 && s_rgid2 < s_rgid)) {
+				s_rgid = s_rgid2;
+				k2_start++;
+			} else {
+				k1++;
+			}
+			append_hit(qh_buf, sh_buf, dist_buf,
+				   i1, s_rgid + 1,
+				   get_distance(q_start, q_end,
+						s_start_p[s_rgid],
+						s_end_p[s_rgid]));
+		}
+	}
+
+	make_ans:
+	PROTECT(ans = NEW_LIST(3));
+	PROTECT(ans_elt = new_INTEGER_from_IntAE(qh_buf));
+	SET_VECTOR_ELT(ans, 0, ans_elt);
+	UNPROTECT(1);
+	PROTECT(ans_elt = new_INTEGER_from_IntAE(sh_buf));
+	SET_VECTOR_ELT(ans, 1, ans_elt);
+	UNPROTECT(1);
+	PROTECT(ans_elt = new_INTEGER_from_IntAE(dist_buf));
+	SET_VECTOR_ELT(ans, 2, ans_elt);
+	UNPROTECT(2);
+	return ans;
+}
+